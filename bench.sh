@@ -0,0 +1,10 @@
+#!/bin/env bash
+set -e
+
+# Builds and runs the benchmark suite. Arguments go to the benchmark,
+# e.g. ./bench.sh --quick --json bench.json
+CXX="${CXX:-g++}"
+CXXFLAGS="-std=c++1y -Ofast -Wall -Wfatal-errors -DBETTER_ASSERT_OFF -DDUNGEON_STATS_OFF -pthread"
+
+$CXX $CXXFLAGS -Isrc bench/bench.cpp -o bench.exe -pthread
+./bench.exe "$@"
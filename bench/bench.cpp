@@ -0,0 +1,410 @@
+#include "dungeon.hpp"
+#include "dungeon_file.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+using namespace std::chrono;
+
+// Every heap allocation in the process goes through here, so allocations
+// per call include those made outside of Dungeon's own counters.
+static atomic<size_t> global_allocations {0};
+
+// Results are written here so the optimizer can't drop the work.
+static volatile size_t keep;
+
+// GCC pairs the frees below with the new-expressions they replace, and
+// warns as if they were mismatched.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void* operator new(size_t sz) {
+    global_allocations.fetch_add(1, memory_order_relaxed);
+    if (void* p = malloc(sz ? sz : 1)) {
+        return p;
+    }
+    throw bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+#pragma GCC diagnostic pop
+
+struct Options {
+    bool quick = false;
+    string json_path;
+    string filter;
+};
+
+struct Result {
+    string name;
+    int width;
+    int height;
+    DungeonParams params;
+    size_t samples;
+    double mean_us;
+    double p50_us;
+    double p99_us;
+    double p999_us;
+    double allocs_per_call;
+    double maps_per_s;
+    double tiles_per_s;
+};
+
+// Runs prepare(i) untimed and then run(i) timed, for i = 0, 1, ... until
+// both the minimum sample count and the time budget are reached.
+template <typename Prepare, typename Run>
+Result measure(Options const& opt, string name, int w, int h, DungeonParams const& params, Prepare&& prepare, Run&& run) {
+    size_t const min_samples = (opt.quick ? 5 : 30);
+    size_t const max_samples = (opt.quick ? 1000 : 100000);
+    auto const budget = duration<double>(opt.quick ? 0.05 : 0.5);
+
+    vector<double> samples;
+    samples.reserve(max_samples);
+    size_t allocs = 0;
+    duration<double> total {};
+
+    for (size_t i=0; i<max_samples && (i<min_samples || total<budget); ++i) {
+        prepare(unsigned(i));
+        auto a0 = global_allocations.load(memory_order_relaxed);
+        auto t0 = steady_clock::now();
+        run(unsigned(i));
+        auto t1 = steady_clock::now();
+        allocs += global_allocations.load(memory_order_relaxed) - a0;
+        total += (t1 - t0);
+        samples.push_back(duration<double, micro>(t1 - t0).count());
+    }
+
+    sort(samples.begin(), samples.end());
+    auto pct = [&](double q){
+        return samples[min(samples.size()-1, size_t(q * samples.size()))];
+    };
+
+    Result rv;
+    rv.name = move(name);
+    rv.width = w;
+    rv.height = h;
+    rv.params = params;
+    rv.samples = samples.size();
+    rv.mean_us = duration<double, micro>(total).count() / samples.size();
+    rv.p50_us = pct(0.5);
+    rv.p99_us = pct(0.99);
+    rv.p999_us = pct(0.999);
+    rv.allocs_per_call = double(allocs) / samples.size();
+    rv.maps_per_s = 1e6 / rv.mean_us;
+    rv.tiles_per_s = rv.maps_per_s * double(w) * h;
+    return rv;
+}
+
+template <typename Run>
+Result measure(Options const& opt, string name, int w, int h, DungeonParams const& params, Run&& run) {
+    return measure(opt, move(name), w, h, params, [](unsigned){}, run);
+}
+
+void print_row(Result const& r) {
+    cout << left << setw(18) << r.name << right
+        << setw(6) << r.width << "x" << left << setw(6) << r.height << right
+        << " d" << setw(2) << r.params.depth_max
+        << " rmin" << r.params.room_width_min
+        << setw(8) << r.samples
+        << fixed << setprecision(1)
+        << setw(11) << r.p50_us
+        << setw(11) << r.p99_us
+        << setw(11) << r.p999_us
+        << setw(9) << r.allocs_per_call
+        << setw(11) << r.maps_per_s
+        << setprecision(0) << setw(14) << r.tiles_per_s
+        << defaultfloat << endl;
+}
+
+void write_json(vector<Result> const& results, ostream& out) {
+    out << "{\n  \"results\": [\n";
+    for (size_t i=0; i<results.size(); ++i) {
+        auto const& r = results[i];
+        out << "    {"
+            << "\"name\": \"" << r.name << "\", "
+            << "\"width\": " << r.width << ", "
+            << "\"height\": " << r.height << ", "
+            << "\"depth_max\": " << r.params.depth_max << ", "
+            << "\"room_width_min\": " << r.params.room_width_min << ", "
+            << "\"room_height_min\": " << r.params.room_height_min << ", "
+            << "\"room_ratio_min\": " << r.params.room_ratio_min << ", "
+            << "\"samples\": " << r.samples << ", "
+            << "\"mean_us\": " << r.mean_us << ", "
+            << "\"p50_us\": " << r.p50_us << ", "
+            << "\"p99_us\": " << r.p99_us << ", "
+            << "\"p999_us\": " << r.p999_us << ", "
+            << "\"allocs_per_call\": " << r.allocs_per_call << ", "
+            << "\"maps_per_s\": " << r.maps_per_s << ", "
+            << "\"tiles_per_s\": " << r.tiles_per_s
+            << "}" << (i+1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+int main(int argc, char* argv[]) try {
+    Options opt;
+    for (int i=1; i<argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--quick") {
+            opt.quick = true;
+        } else if (arg == "--json" && i+1 < argc) {
+            opt.json_path = argv[++i];
+        } else if (arg == "--filter" && i+1 < argc) {
+            opt.filter = argv[++i];
+        } else {
+            cerr << "Usage: " << argv[0] << " [--quick] [--json FILE] [--filter NAME]" << endl;
+            return -1;
+        }
+    }
+
+    vector<Result> results;
+    auto add = [&](Result r){
+        print_row(r);
+        results.push_back(move(r));
+    };
+    auto enabled = [&](char const* name){
+        return opt.filter.empty() || string(name).find(opt.filter) != string::npos;
+    };
+
+    cout << left << setw(18) << "benchmark" << right << setw(13) << "size"
+        << setw(15) << "samples" << setw(11) << "p50 us" << setw(11) << "p99 us"
+        << setw(11) << "p999 us" << setw(9) << "allocs" << setw(11) << "maps/s"
+        << setw(14) << "tiles/s" << endl;
+
+    struct Size { int w, h; };
+    vector<Size> const sizes = (opt.quick
+        ? vector<Size>{{64, 48}, {256, 256}}
+        : vector<Size>{{64, 48}, {256, 256}, {1024, 1024}, {4096, 4096}});
+
+    Dungeon dung;
+
+    // Generation over the parameter matrix. Every call uses a new seed.
+    if (enabled("go")) {
+        for (auto sz : sizes) {
+            for (int depth : {8, 15}) {
+                for (int room_min : {3, 6}) {
+                    DungeonParams params;
+                    params.depth_max = depth;
+                    params.room_width_min = room_min;
+                    params.room_height_min = room_min;
+                    dung.set_params(params);
+                    add(measure(opt, "go", sz.w, sz.h, params, [&](unsigned i){
+                        dung.seed(i);
+                        dung.go(sz.w, sz.h);
+                    }));
+                }
+            }
+        }
+        dung.set_params(DungeonParams{});
+    }
+
+    // Generation with each engine, default parameters.
+    if (enabled("go_engine")) {
+        auto bench_engine = [&](auto& d, char const* name){
+            for (auto sz : sizes) {
+                add(measure(opt, name, sz.w, sz.h, DungeonParams{}, [&](unsigned i){
+                    d.seed(i);
+                    d.go(sz.w, sz.h);
+                }));
+            }
+        };
+        BasicDungeon<Pcg32> pcg;
+        BasicDungeon<Xoshiro256ss> xoshiro;
+        BasicDungeon<SplitMix64> splitmix;
+        bench_engine(dung, "go_engine_mt19937");
+        bench_engine(pcg, "go_engine_pcg32");
+        bench_engine(xoshiro, "go_engine_xoshiro");
+        bench_engine(splitmix, "go_engine_splitmix");
+        dung.set_counter_rng(true);
+        bench_engine(dung, "go_engine_counter");
+        dung.set_counter_rng(false);
+    }
+
+    // Default parameters fixed at compile time, against go_engine_mt19937.
+    if (enabled("go_fixed")) {
+        auto fixed = make_unique<BasicDungeon<mt19937, FixedParams<3, 3, ratio<3,10>, 15, 1024>>>();
+        for (auto sz : sizes) {
+            add(measure(opt, "go_fixed", sz.w, sz.h, DungeonParams{}, [&](unsigned i){
+                fixed->seed(i);
+                fixed->go(sz.w, sz.h);
+            }));
+        }
+    }
+
+    // Level at a time generation, inline and on a pool, against go_engine_counter.
+    if (enabled("go_levels")) {
+        Dungeon::Workers tw;
+        dung.set_counter_rng(true);
+        for (auto pool : {false, true}) {
+            dung.set_parallel(pool ? &tw : nullptr, 0);
+            for (auto sz : sizes) {
+                add(measure(opt, (pool ? "go_levels_pool" : "go_levels"), sz.w, sz.h, DungeonParams{}, [&](unsigned i){
+                    dung.seed(i);
+                    dung.go_levels(sz.w, sz.h);
+                }));
+            }
+        }
+        dung.set_parallel(nullptr, 0);
+        dung.set_counter_rng(false);
+    }
+
+    // A query of each size in the middle of a map too big to carve whole.
+    if (enabled("go_region")) {
+        int const world = 1 << 20;
+        DungeonParams params;
+        params.depth_max = 40;
+        dung.set_params(params);
+        dung.set_counter_rng(true);
+        for (auto sz : sizes) {
+            Rect const query {world/2, world/2 + sz.h, world/2, world/2 + sz.w};
+            add(measure(opt, "go_region", sz.w, sz.h, params, [&](unsigned i){
+                dung.seed(i);
+                dung.go_region(world, world, query);
+            }));
+        }
+        dung.set_counter_rng(false);
+        dung.set_params(DungeonParams{});
+    }
+
+    // Rerolling a node four levels down, against the go() it saves.
+    if (enabled("reroll")) {
+        for (auto sz : sizes) {
+            uint32_t idx = 0;
+            auto prepare = [&](unsigned){
+                dung.seed(1);
+                dung.go(sz.w, sz.h);
+                auto tree = dung.get_tree();
+                idx = 0;
+                for (int i=0; i<4 && tree[idx].dir != Dir::NONE; ++i) {
+                    idx = tree[idx].children[i % 2];
+                }
+            };
+            add(measure(opt, "reroll", sz.w, sz.h, DungeonParams{}, prepare, [&](unsigned i){
+                keep = dung.reroll(idx, i);
+            }));
+        }
+    }
+
+    // Output and transforms, on one dungeon per size.
+    DungeonParams params;
+    for (auto sz : sizes) {
+        dung.seed(1);
+        dung.go(sz.w, sz.h);
+        int const w = sz.w;
+        int const h = sz.h;
+
+        if (enabled("raster_bytes")) {
+            vector<unsigned char> bytes (size_t(w) * h);
+            add(measure(opt, "raster_bytes", w, h, params, [&](unsigned){
+                dung.rasterize(bytes.data(), w);
+            }));
+        }
+
+        if (enabled("raster_packed")) {
+            PackedTiles packed;
+            add(measure(opt, "raster_packed", w, h, params, [&](unsigned){
+                dung.rasterize(packed);
+            }));
+        }
+
+        if (enabled("stream_bands")) {
+            BandRasterizer rast;
+            add(measure(opt, "stream_bands", w, h, params, [&](unsigned){
+                dung.stream_tiles(rast, 64, [&](int, int rows, unsigned char const* tiles, size_t stride){
+                    keep = tiles[(rows-1) * stride];
+                });
+            }));
+        }
+
+        // One lookup per tile of a diagonal.
+        if (enabled("locate")) {
+            add(measure(opt, "locate", w, h, params, [&](unsigned){
+                for (int i=0; i<min(w,h); ++i) {
+                    keep = (dung.locate(i, i) != nullptr);
+                }
+            }));
+        }
+
+        if (enabled("grid_build")) {
+            SpaceGrid grid;
+            add(measure(opt, "grid_build", w, h, params, [&](unsigned){
+                grid.build(dung.get_table(), w, h);
+            }));
+        }
+
+        // A 16 by 16 window at every 8th tile of a diagonal.
+        if (enabled("grid_query")) {
+            SpaceGrid grid;
+            grid.build(dung.get_table(), w, h);
+            auto const view = grid.view();
+            add(measure(opt, "grid_query", w, h, params, [&](unsigned){
+                for (int i=0; i<min(w,h); i+=8) {
+                    view.query(dung.get_table(), Rect{i, i+16, i, i+16}, [&](SpaceId id){
+                        keep = id;
+                    });
+                }
+            }));
+        }
+
+        if (enabled("serialize")) {
+            add(measure(opt, "serialize", w, h, params, [&](unsigned){
+                DungeonBlob blob (dung);
+                keep = blob.size();
+            }));
+        }
+
+        if (enabled("view_load")) {
+            DungeonBlob blob (dung);
+            add(measure(opt, "view_load", w, h, params, [&](unsigned){
+                DungeonView view (blob.data(), blob.size());
+                keep = view.size();
+            }));
+        }
+
+        if (enabled("transform")) {
+            auto table = dung.get_table();
+            auto const orig = table;
+            Transform xf (w, h);
+            xf.mult(3).sub(1).transpose().flip_rows();
+            auto prepare = [&](unsigned){
+                table = orig;
+            };
+            add(measure(opt, "transform", xf.width(), xf.height(), params, prepare, [&](unsigned){
+                xf.apply(table);
+            }));
+            add(measure(opt, "transform_scalar", xf.width(), xf.height(), params, prepare, [&](unsigned){
+                xf.apply_scalar(table);
+            }));
+        }
+    }
+
+    if (!opt.json_path.empty()) {
+        ofstream out (opt.json_path);
+        write_json(results, out);
+        if (!out) {
+            cerr << "Cannot write " << opt.json_path << endl;
+            return -1;
+        }
+    }
+} catch (exception const& e) {
+    cerr << "EXCEPTION!" << endl;
+    cerr << e.what() << endl;
+    return -1;
+}
@@ -2,8 +2,8 @@
 set -e
 
 export CPPFLAGS=""
-export CXXFLAGS="-std=c++1y -Ofast -Wall -Wfatal-errors -DBETTER_ASSERT_OFF"
-export LDFLAGS="-Ofast"
+export CXXFLAGS="-std=c++1y -Ofast -Wall -Wfatal-errors -DBETTER_ASSERT_OFF -DDUNGEON_STATS_OFF -pthread"
+export LDFLAGS="-Ofast -pthread"
 respite
 
 mv a.respite gen.exe
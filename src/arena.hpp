@@ -0,0 +1,116 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include "better_assert.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+// Counts the heap allocations made on behalf of one owner.
+struct AllocCounter {
+    std::size_t allocations = 0;
+    std::size_t bytes = 0;
+
+    void count(std::size_t sz) {
+        ++allocations;
+        bytes += sz;
+    }
+};
+
+// std::allocator that reports every allocation to an AllocCounter.
+template <typename T>
+struct CountingAllocator {
+    using value_type = T;
+
+    AllocCounter* counter = nullptr;
+
+    CountingAllocator() = default;
+    explicit CountingAllocator(AllocCounter* counter) : counter(counter) {}
+
+    template <typename U>
+    CountingAllocator(CountingAllocator<U> const& other) : counter(other.counter) {}
+
+    T* allocate(std::size_t n) {
+        if (counter) {
+            counter->count(n * sizeof(T));
+        }
+        return std::allocator<T>{}.allocate(n);
+    }
+
+    void deallocate(T* p, std::size_t n) {
+        std::allocator<T>{}.deallocate(p, n);
+    }
+
+    template <typename U>
+    bool operator==(CountingAllocator<U> const& other) const {
+        return (counter == other.counter);
+    }
+
+    template <typename U>
+    bool operator!=(CountingAllocator<U> const& other) const {
+        return (counter != other.counter);
+    }
+};
+
+template <typename T>
+using CountedVector = std::vector<T, CountingAllocator<T>>;
+
+// Monotonic arena for trivially destructible scratch data.
+// reserve() sizes it once, and reset() hands the same block out again, so
+// repeated use at the same or a smaller size never touches the heap.
+class MonotonicArena {
+    std::unique_ptr<unsigned char[]> block;
+    std::size_t cap = 0;
+    std::size_t pos = 0;
+    AllocCounter* counter = nullptr;
+
+    static std::size_t align_up(std::size_t n, std::size_t a) {
+        return (n + a - 1) / a * a;
+    }
+
+public:
+
+    MonotonicArena() = default;
+    explicit MonotonicArena(AllocCounter* counter) : counter(counter) {}
+
+    // Bytes needed to hold n Ts, including worst case alignment padding.
+    template <typename T>
+    static std::size_t footprint(std::size_t n) {
+        return n * sizeof(T) + alignof(T) - 1;
+    }
+
+    // Discards everything allocated and makes sure the next bytes fit.
+    void reset(std::size_t bytes) {
+        pos = 0;
+        if (bytes > cap) {
+            block.reset(new unsigned char[bytes]);
+            cap = bytes;
+            if (counter) {
+                counter->count(bytes);
+            }
+        }
+    }
+
+    template <typename T>
+    T* allocate(std::size_t n) {
+        auto start = align_up(pos, alignof(T));
+        auto end = start + n * sizeof(T);
+        if (end > cap) {
+            throw std::bad_alloc();
+        }
+        pos = end;
+        return reinterpret_cast<T*>(&block[start]);
+    }
+
+    std::size_t capacity() const {
+        return cap;
+    }
+
+    std::size_t used() const {
+        return pos;
+    }
+};
+
+#endif // ARENA_HPP
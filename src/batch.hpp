@@ -0,0 +1,75 @@
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include "dungeon.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Generates a w by h dungeon for every seed in seeds.
+// Every thread owns one Dungeon and reuses it for all of its seeds, so each
+// result is identical to calling seed() and go() on a fresh Dungeon.
+// sink(index, seed, dungeon) is called on the generating thread as soon as
+// a dungeon is done, and must be safe to call concurrently. The dungeon is
+// only valid until sink returns.
+// The first exception thrown stops the batch and is rethrown here.
+// Dung picks the engine and config, as in generate_batch<BasicDungeon<Pcg32>>(...).
+template <typename Dung = Dungeon, typename Seeds, typename Sink>
+void generate_batch(
+    Seeds const& seeds, int w, int h, DungeonParams const& params,
+    Sink&& sink, unsigned num_threads = 0
+) {
+    std::size_t const count = seeds.size();
+
+    if (num_threads == 0) {
+        num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    num_threads = unsigned(std::min<std::size_t>(num_threads, count));
+
+    std::atomic<std::size_t> next {0};
+    std::atomic<bool> failed {false};
+    std::exception_ptr error;
+    std::mutex error_mt;
+
+    auto work = [&]{
+        Dung dung;
+        dung.set_params(params);
+        try {
+            for (auto i = next++; i < count && !failed; i = next++) {
+                auto const& s = seeds[i];
+                dung.seed(s);
+                dung.go(w, h);
+                sink(i, s, static_cast<Dung const&>(dung));
+            }
+        } catch (...) {
+            std::unique_lock<std::mutex> lk (error_mt);
+            if (!failed) {
+                error = std::current_exception();
+                failed = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads);
+    for (unsigned i=1; i<num_threads; ++i) {
+        threads.emplace_back(work);
+    }
+    if (num_threads > 0) {
+        work();
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+#endif // BATCH_HPP
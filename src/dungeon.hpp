@@ -1,10 +1,20 @@
+#ifndef DUNGEON_HPP
+#define DUNGEON_HPP
+
 #include "ranges.hpp"
 #include "space.hpp"
 #include "nd_rand.hpp"
+#include "rng.hpp"
 #include "better_assert.hpp"
 #include "array_vector.hpp"
 #include "array_view.hpp"
 #include "thread_worker.hpp"
+#include "arena.hpp"
+#include "space_table.hpp"
+#include "space_grid.hpp"
+#include "transform.hpp"
+#include "raster.hpp"
+#include "dungeon_stats.hpp"
 
 #include <algorithm>
 #include <iterator>
@@ -17,6 +27,10 @@
 #include <iostream>
 #include <future>
 #include <mutex>
+#include <memory>
+#include <limits>
+#include <array>
+#include <ratio>
 
 using namespace std;
 
@@ -39,13 +53,6 @@ enum class Cardinal {
     EAST,
 };
 
-constexpr auto cardinals = {
-    Cardinal::NORTH,
-    Cardinal::SOUTH,
-    Cardinal::WEST,
-    Cardinal::EAST,
-};
-
 inline ostream& operator<<(ostream& out, Cardinal const& car) {
     static const string strs[] = {
         "NORTH",
@@ -85,6 +92,17 @@ inline Dir car2dir(Cardinal car) {
     return dirs[int(car)];
 }
 
+// Calls f(integral_constant<Dir,dir>{}), so that f can be compiled for
+// each direction and switch on it only once.
+template <typename F>
+decltype(auto) dispatch_dir(Dir dir, F&& f) {
+    switch (dir) {
+        case Dir::HORIZ: return f(integral_constant<Dir,Dir::HORIZ>{});
+        case Dir::VERT: return f(integral_constant<Dir,Dir::VERT>{});
+        default: throw logic_error("Must be valid direction!");
+    }
+}
+
 template <typename Comp>
 vector<Space*> get_partition_data(ArrayView<Space>& spaces, Dir dir, int lat_begin, int lat_end, Comp comp) {
     vector<Space*> rv (lat_end - lat_begin, nullptr);
@@ -107,6 +125,10 @@ struct AreaData {
     ArrayView<Space*> views[4];
     ArrayView<Space> spaces;
 
+    // Node of the split tree the area is, the root being 1 and the halves
+    // of node n being 2n and 2n+1.
+    uint64_t node = 1;
+
     ArrayView<Space*>& get_view(Cardinal car) {
         AreaData const& self = *this;
         return const_cast<ArrayView<Space*>&>(self.get_view(car));
@@ -143,58 +165,484 @@ struct AreaData {
     }
 };
 
-class Dungeon {
+struct DungeonParams {
+    int room_width_min = 3;
+    int room_height_min = 3;
+    double room_ratio_min = 0.3;
+
+    int depth_max = 15;
+
+    // Split caches of this size or less live in the dungeon, see FixedParams.
+    static constexpr size_t cache_max = 0;
+
+    // What BasicDungeon needs of its Config besides the fields above.
+
+    int times_ratio(int x) const {
+        return int(x * room_ratio_min);
+    }
+
+    int over_ratio(int x) const {
+        return int(x / room_ratio_min);
+    }
+
+    DungeonParams get() const {
+        return *this;
+    }
+
+    void set(DungeonParams const& params) {
+        *this = params;
+    }
+
+    bool operator==(DungeonParams const& other) const {
+        return room_width_min == other.room_width_min
+            && room_height_min == other.room_height_min
+            && room_ratio_min == other.room_ratio_min
+            && depth_max == other.depth_max;
+    }
+
+    bool operator!=(DungeonParams const& other) const {
+        return !(*this == other);
+    }
+};
+
+// Params fixed at compile time, as a Config for BasicDungeon, for level
+// types that never change them. RatioMin is a std::ratio, which makes the
+// ratio math integer, a multiply and a divide by a constant. Maps are those
+// of DungeonParams with the ratio as a double only while none of its double
+// products falls just below an integer, as 90*0.7 does (62.99...): 3/10 and
+// 1/4 give the same maps, 7/10 doesn't.
+// Maps up to SideMax a side keep the split cache in the dungeon itself,
+// since depth_max bounds how much of it a carve can use; 0 leaves it in
+// the dungeon's scratch memory.
+template <int WidthMin, int HeightMin, typename RatioMin, int DepthMax, int SideMax = 0>
+struct FixedParams {
+    static_assert(RatioMin::num > 0, "FixedParams: RatioMin must be positive!");
+
+    static constexpr int room_width_min = WidthMin;
+    static constexpr int room_height_min = HeightMin;
+    static constexpr double room_ratio_min = double(RatioMin::num) / RatioMin::den;
+
+    static constexpr int depth_max = DepthMax;
+
+    // Every split above the last level holds two views at most as long as
+    // the map's longer side.
+    static constexpr size_t cache_max = size_t(SideMax) * 2 * size_t(DepthMax > 1 ? DepthMax - 1 : 0);
+
+    static int times_ratio(int x) {
+        return int(int64_t(x) * RatioMin::num / RatioMin::den);
+    }
+
+    static int over_ratio(int x) {
+        return int(int64_t(x) * RatioMin::den / RatioMin::num);
+    }
+
+    static DungeonParams get() {
+        DungeonParams rv;
+        rv.room_width_min = room_width_min;
+        rv.room_height_min = room_height_min;
+        rv.room_ratio_min = room_ratio_min;
+        rv.depth_max = depth_max;
+        return rv;
+    }
+
+    // Only the params it was made with can be set.
+    static void set(DungeonParams const& params) {
+        if (params != get()) {
+            throw logic_error("FixedParams::set(): Params are fixed at compile time!");
+        }
+    }
+};
+
+template <int W, int H, typename R, int D, int S>
+constexpr int FixedParams<W,H,R,D,S>::room_width_min;
+template <int W, int H, typename R, int D, int S>
+constexpr int FixedParams<W,H,R,D,S>::room_height_min;
+template <int W, int H, typename R, int D, int S>
+constexpr double FixedParams<W,H,R,D,S>::room_ratio_min;
+template <int W, int H, typename R, int D, int S>
+constexpr int FixedParams<W,H,R,D,S>::depth_max;
+template <int W, int H, typename R, int D, int S>
+constexpr size_t FixedParams<W,H,R,D,S>::cache_max;
+
+// Generator, templated on the random engine driving it.
+// Engine is any seedable UniformRandomBitGenerator, like the ones in
+// rng.hpp. A seed gives the same dungeon for as long as the engine and
+// uniform_int() draw the same numbers from it.
+// Config holds the params: DungeonParams to set them at runtime, or a
+// FixedParams.
+template <typename Engine, typename Config = DungeonParams>
+class BasicDungeon {
     friend class DungeonTests;
 
-    using SpaceVec = vector<Space>;
-    SpaceVec rooms;
+    // Every heap allocation made by the containers below is counted here.
+    AllocCounter counter;
+
+    // What the last go() did, see dungeon_stats.hpp.
+    DungeonStats stats;
+    DungeonPhaseTimer::State phase_state;
+
+    template <typename T>
+    CountingAllocator<T> counted() {
+        return CountingAllocator<T>(&counter);
+    }
+
+    using SpaceVec = CountedVector<Space>;
+    SpaceVec rooms = SpaceVec(counted<Space>());
+
+    // If set, rooms is first reserved no bigger than this, so tests can
+    // force carve_with_retry() to retry.
+    size_t rooms_reserve_max = 0;
+
+    // Shapes of rooms, refreshed at the end of go().
+    SpaceTable table {&counter};
+
+    // Built from table along with it, if use_grid is set.
+    SpaceGrid grid {&counter};
+    bool use_grid = false;
 
     int width = 0;
     int height = 0;
 
-    int room_width_min = 3;
-    int room_height_min = 3;
-    double room_ratio_min = 0.3;
+    Config config;
 
-    int depth_max = 15;
+    uint64_t seed_value = nd_rand();
+    Engine rng {typename Engine::result_type(seed_value)};
 
-    mt19937 rng {nd_rand()};
-    uniform_int_distribution<int> dist;
+    // Whether draws come from counter_key() instead of rng.
+    bool counter_rng = false;
 
-    vector<Space*> cache;
+    // Scratch memory for one generation.
+    // Sized by reserve_buffers() and handed out again by every later call.
+    MonotonicArena scratch {&counter};
+
+    // Stack of boundary views for splits in progress, see push_cache_view().
+    // Sized by max_cache(), so it never runs out.
+    ArrayView<Space*> cache;
     size_t cache_pos = 0;
 
-    struct CacheViewHandle {
-        Dungeon* dung;
-        ArrayView<Space*> view;
+    // Holds the cache instead of scratch when it fits, see FixedParams.
+    array<Space*, Config::cache_max> cache_storage;
+
+    ArrayView<Space*> border;
+
+    // Neighbor graph.
+    // While carving, every space has a linked list of edges in edge_nodes.
+    // go() packs them into edge_offsets/edge_targets for neighbors().
+
+    static constexpr uint32_t no_edge = uint32_t(-1);
+
+    struct EdgeNode {
+        SpaceId to;
+        uint32_t next;
+    };
+
+    struct EdgeList {
+        uint32_t head = no_edge;
+        uint32_t tail = no_edge;
+    };
+
+    // A hall adds 2 edges per end, or 8 when the end is a hall that has to
+    // be split by a junction (which adds 2 spaces). There are fewer halls
+    // than rooms, so there are fewer than 3 edges per space.
+    static constexpr int max_edges_per_space = 3;
+
+    CountedVector<EdgeNode> edge_nodes = CountedVector<EdgeNode>(counted<EdgeNode>());
+    CountedVector<EdgeList> edge_lists = CountedVector<EdgeList>(counted<EdgeList>());
+    CountedVector<uint32_t> edge_offsets = CountedVector<uint32_t>(counted<uint32_t>());
+    CountedVector<SpaceId> edge_targets = CountedVector<SpaceId>(counted<SpaceId>());
+
+public:
+
+    using Workers = ThreadWorker<AreaData>;
+
+    static constexpr uint32_t no_node = uint32_t(-1);
+
+    // A node of the split tree of the last go() or go_region(), stored in
+    // preorder. Splits have dir and pos as in Rect::split(), children[0]
+    // being the half before pos. A node's subtree has the spaces
+    // [space_begin, space_end) of get_spaces(); those in neither child are
+    // the split's own halls and junctions. bounds covers all of them.
+    struct SplitNode {
+        Rect bounds;
+        Dir dir = Dir::NONE;
+        int pos = 0;
+        uint32_t children[2] = {no_node, no_node};
+        SpaceId space_begin = 0;
+        SpaceId space_end = 0;
+    };
+
+    // A node of the split tree as the last go_region() left it.
+    struct RegionNode {
+        Rect rect;
+        uint64_t node = 1;
+        int depth = 1;
+        int parent = -1;
+
+        // Split of the node, NONE for chunks and nodes left unexpanded.
+        Dir dir = Dir::NONE;
+        int pos = 0;
+        int children[2] = {-1, -1};
+
+        // Index of the split's corridor in get_spaces().
+        int corridor = -1;
+
+        // Job carving the node, if it's a chunk.
+        int chunk = -1;
+
+        // Index of the node in get_tree().
+        uint32_t tree = no_node;
+
+        bool expanded() const {
+            return dir != Dir::NONE || chunk >= 0;
+        }
+    };
+
+private:
+
+    // Split tree, built while carving, see SplitNode.
+    CountedVector<SplitNode> tree = CountedVector<SplitNode>(counted<SplitNode>());
+
+    // Parallel generation.
+    // The top parallel_depth levels of the tree are split on the calling
+    // thread, and every subtree below them is carved as an independent job
+    // with its own rng stream, seeded from this dungeon's rng.
+
+    struct SplitPlan {
+        Rect rect;
+        Dir dir = Dir::NONE;
+        int pos = 0;
+        int children[2] = {-1, -1};
+        int job = -1;
+    };
+
+    struct SubtreeJob {
+        Rect rect;
+        int depth;
+        uint64_t node;
+        typename Engine::result_type seed;
+    };
+
+    Workers* workers = nullptr;
+    int parallel_depth = 0;
+
+    CountedVector<SplitPlan> plan = CountedVector<SplitPlan>(counted<SplitPlan>());
+    CountedVector<SubtreeJob> jobs = CountedVector<SubtreeJob>(counted<SubtreeJob>());
+    CountedVector<AreaData> job_results = CountedVector<AreaData>(counted<AreaData>());
+    CountedVector<Workers::Future> job_futures = CountedVector<Workers::Future>(counted<Workers::Future>());
+    CountedVector<unique_ptr<BasicDungeon>> job_dungeons = CountedVector<unique_ptr<BasicDungeon>>(counted<unique_ptr<BasicDungeon>>());
+
+    // Pushes a view of sz entries onto the cache.
+    // The view is left uninitialized.
+    // Leaves write every entry of their views, see carve_leaf().
+    ArrayView<Space*> push_cache_view(size_t sz) {
+        assert(cache_pos + sz <= size_t(cache.size()));
+        auto rv = ArrayView<Space*>(cache.begin() + cache_pos, sz);
+        cache_pos += sz;
+        dungeon_stat_max(cache_high_water, cache_pos);
+        return rv;
+    }
+
+    // Pops view, which must be the last one pushed, off the cache.
+    void pop_cache_view(ArrayView<Space*> const& view) {
+        assert(cache.begin() + cache_pos == view.end());
+        cache_pos -= view.size();
+    }
+
+    SpaceId id_of(Space const* sp) const {
+        assert(sp >= rooms.data() && sp < rooms.data() + rooms.size());
+        return SpaceId(sp - rooms.data());
+    }
+
+    void add_edge(SpaceId from, SpaceId to) {
+        auto node = uint32_t(edge_nodes.size());
+        edge_nodes.push_back(EdgeNode{to, no_edge});
+        auto& list = edge_lists[from];
+        if (list.tail == no_edge) {
+            list.head = node;
+        } else {
+            edge_nodes[list.tail].next = node;
+        }
+        list.tail = node;
+    }
+
+    void add_edge(Space* from, Space* to) {
+        add_edge(id_of(from), id_of(to));
+    }
+
+    void remove_edge(Space* from, Space* to) {
+        auto& list = edge_lists[id_of(from)];
+        auto target = id_of(to);
+        auto prev = no_edge;
+        for (auto e = list.head; e != no_edge; prev = e, e = edge_nodes[e].next) {
+            if (edge_nodes[e].to == target) {
+                auto next = edge_nodes[e].next;
+                if (prev == no_edge) {
+                    list.head = next;
+                } else {
+                    edge_nodes[prev].next = next;
+                }
+                if (list.tail == e) {
+                    list.tail = prev;
+                }
+                return;
+            }
+        }
+        assert(false);
+    }
+
+    void link(Space* a, Space* b) {
+        add_edge(a, b);
+        add_edge(b, a);
+    }
 
-        CacheViewHandle(Dungeon* dung, size_t sz) : dung(dung) {
-            view = ArrayView<Space*>(&dung->cache[dung->cache_pos], sz);
-            dung->cache_pos += sz;
+    // Returns the first neighbor of sp matching pred, or nullptr.
+    template <typename Pred>
+    Space* find_neighbor(Space* sp, Pred&& pred) {
+        for (auto e = edge_lists[id_of(sp)].head; e != no_edge; e = edge_nodes[e].next) {
+            Space& n = rooms[edge_nodes[e].to];
+            if (pred(n)) {
+                return &n;
+            }
         }
+        return nullptr;
+    }
 
-        ~CacheViewHandle() {
-            assert(&dung->cache[dung->cache_pos] == view.end());
-            dung->cache_pos -= view.size();
+    void clear_edges() {
+        edge_nodes.clear();
+        edge_lists.clear();
+    }
+
+    // Packs the edge lists of the spaces from from on, keeping the packed
+    // edges of those before it.
+    void pack_edges(SpaceId from = 0) {
+        edge_offsets.resize(rooms.size() + 1);
+        edge_targets.resize(edge_offsets[from]);
+        for (SpaceId i : number_range(from,SpaceId(rooms.size()))) {
+            edge_offsets[i] = uint32_t(edge_targets.size());
+            for (auto e = edge_lists[i].head; e != no_edge; e = edge_nodes[e].next) {
+                edge_targets.push_back(edge_nodes[e].to);
+            }
         }
+        edge_offsets[rooms.size()] = uint32_t(edge_targets.size());
+    }
+
+    // Where a draw is made at its node, keying it in counter mode.
+    // The region draws have one slot per Cardinal, added to them.
+    enum Draw : uint32_t {
+        DRAW_SPLIT,
+        DRAW_HALL,
+        DRAW_ROOM_LAT,
+        DRAW_ROOM_LONG,
+        DRAW_REGION_EDGE,
+        DRAW_REGION_LINK = DRAW_REGION_EDGE + 4,
     };
 
-    CacheViewHandle get_cache_view(size_t sz) {
-        if (cache_pos + sz > cache.size()) {
-            throw runtime_error("Out of cache memory!");
+    // Uniform integer in [a,b] for a draw at node.
+    // In counter mode it only depends on the seed, node and draw, so a
+    // subtree carves the same no matter what was carved before it.
+    int roll_rng(uint64_t node, Draw draw, int a, int b) {
+        if (counter_rng) {
+            CounterStream stream (counter_key(seed_value, node, draw));
+            return uniform_int(stream, a, b);
+        }
+        return uniform_int(rng, a, b);
+    }
+
+    void build_grid() {
+        if (use_grid) {
+            grid.build(table, width, height);
+        } else {
+            grid.clear();
+        }
+    }
+
+    uint32_t push_tree_node(Dir dir, int pos) {
+        tree.push_back(SplitNode{});
+        tree.back().dir = dir;
+        tree.back().pos = pos;
+        return uint32_t(tree.size() - 1);
+    }
+
+    // Calls f(space) for the spaces a node has that its children don't.
+    // Children's spaces are contiguous, but may come before or after them.
+    template <typename F>
+    void for_own_spaces(SplitNode const& n, F&& f) const {
+        auto lo = n.space_end;
+        auto hi = n.space_end;
+        if (n.dir != Dir::NONE) {
+            auto const& a = tree[n.children[0]];
+            auto const& b = tree[n.children[1]];
+            lo = min(a.space_begin, b.space_begin);
+            hi = max(a.space_end, b.space_end);
+        }
+        for (SpaceId i : number_range(n.space_begin, lo)) {
+            f(rooms[i]);
+        }
+        for (SpaceId i : number_range(hi, n.space_end)) {
+            f(rooms[i]);
+        }
+    }
+
+    // Recomputes node i's bounds from its own spaces and its children's bounds.
+    void refit_node(uint32_t i) {
+        auto grow = [](Rect& r, Rect const& o, bool& empty){
+            if (empty) {
+                r = o;
+                empty = false;
+                return;
+            }
+            r.begin_r = min(r.begin_r, o.begin_r);
+            r.end_r = max(r.end_r, o.end_r);
+            r.begin_c = min(r.begin_c, o.begin_c);
+            r.end_c = max(r.end_c, o.end_c);
+        };
+
+        auto& n = tree[i];
+        bool empty = true;
+        n.bounds = Rect{0, 0, 0, 0};
+        for_own_spaces(n, [&](Space const& sp){
+            grow(n.bounds, get_shape(sp), empty);
+        });
+        if (n.dir != Dir::NONE) {
+            for (auto c : n.children) {
+                if (tree[c].space_begin != tree[c].space_end) {
+                    grow(n.bounds, tree[c].bounds, empty);
+                }
+            }
+        }
+    }
+
+    // Recomputes every node's bounds from the current shapes of rooms.
+    // Children come after their parents, so a backward pass sees them first.
+    void refit_tree() {
+        for (auto i = tree.size(); i-- > 0;) {
+            refit_node(uint32_t(i));
         }
-        auto rv = CacheViewHandle(this, sz);
-        fill(begin(rv.view),end(rv.view),nullptr);
-        return rv;
     }
 
-    int roll_rng(int a, int b) {
-        auto params = uniform_int_distribution<int>::param_type(a,b);
-        return dist(rng,params);
+    // Calls sink(space) for the spaces of node idx's subtree intersecting
+    // rect, skipping subtrees whose bounds don't. Stops once sink returns true.
+    template <typename Sink>
+    bool visit_tree(uint32_t idx, Rect const& rect, Sink& sink) const {
+        auto const& n = tree[idx];
+        if (n.space_begin == n.space_end || !n.bounds.intersects(rect)) {
+            return false;
+        }
+        bool done = false;
+        for_own_spaces(n, [&](Space const& sp){
+            if (!done && get_shape(sp).intersects(rect)) {
+                done = sink(sp);
+            }
+        });
+        if (done || n.dir == Dir::NONE) {
+            return done;
+        }
+        return visit_tree(n.children[0], rect, sink) || visit_tree(n.children[1], rect, sink);
     }
 
     ArrayView<Space> create_junction(Space* hall, Dir dir, int split_loc) {
         assert(hall);
+        dungeon_stat_count(junctions);
 
         auto junction = add_space(Space{});
         auto newhall = add_space(Space{});
@@ -206,23 +654,19 @@ class Dungeon {
 
         // Cut connections on end of hall, connect to newhall
 
-        auto iter = find_if(begin(hall->neighbors),end(hall->neighbors), [=](Space* sp){
-            auto rect = get_shape(*sp);
-            return (rect.begin_latitude(dir) == hall->data.hall.end);
+        auto hall_end = hall->data.hall.end;
+        auto sp = find_neighbor(hall, [&](Space const& n){
+            auto rect = get_shape(n);
+            return (rect.begin_latitude(dir) == hall_end);
         });
 
         assert(sp);
 
-        Space* sp = *iter;
-
-        auto sp_iter = find(begin(sp->neighbors),end(sp->neighbors), hall);
-        assert(sp_iter != end(sp->neighbors));
+        remove_edge(sp, hall);
+        add_edge(sp, newhall);
 
-        sp->neighbors.erase(sp_iter);
-        sp->neighbors.push_back(newhall);
-
-        newhall->neighbors.push_back(sp);
-        hall->neighbors.erase(iter);
+        add_edge(newhall, sp);
+        remove_edge(hall, sp);
 
         // Physically separate hall and newhall
 
@@ -239,10 +683,8 @@ class Dungeon {
 
         // Connect junction to hall and newhall
 
-        hall->neighbors.push_back(junction);
-        newhall->neighbors.push_back(junction);
-        junction->neighbors.push_back(hall);
-        junction->neighbors.push_back(newhall);
+        link(hall, junction);
+        link(newhall, junction);
 
         return rv;
     }
@@ -255,14 +697,12 @@ class Dungeon {
 
         switch (ptr->type) {
             case SpaceType::ROOM: {
-                space->neighbors.push_back(ptr);
-                ptr->neighbors.push_back(space);
+                link(space, ptr);
             } break;
 
             case SpaceType::HALL: {
                 rv = create_junction(ptr, dir, loc);
-                space->neighbors.push_back(&rv[0]);
-                rv[0].neighbors.push_back(space);
+                link(space, &rv[0]);
             } break;
 
             default: {
@@ -273,8 +713,10 @@ class Dungeon {
         return rv;
     }
 
-    ArrayView<Space> carve_hallway(AreaData const& first, AreaData const& second, Dir dir) {
-        auto cards = get_cardinals(dir);
+    template <Dir D>
+    ArrayView<Space> carve_hallway(AreaData const& first, AreaData const& second, uint64_t node) {
+        dungeon_stat_phase(HALLS);
+        auto const cards = get_cardinals(D);
 
         auto& first_data = first.get_view(cards.longitude.second);
         auto& second_data = second.get_view(cards.longitude.first);
@@ -297,7 +739,7 @@ class Dungeon {
 
         assert(b-a > 0);
 
-        int loc = roll_rng(a,b-1);
+        int loc = roll_rng(node, DRAW_HALL, a, b-1);
 
         assert(loc >= 0);
         assert(loc < first_data.size());
@@ -311,14 +753,14 @@ class Dungeon {
 
         // Create hall data.
         HallData hd;
-        hd.dir = dir;
-        hd.dir_loc = loc + first.rect.begin_latitude(dir);
-        hd.begin = get_shape(*first_ptr).end_longitude(dir);
-        hd.end = get_shape(*second_ptr).begin_longitude(dir);
+        hd.dir = D;
+        hd.dir_loc = loc + first.rect.begin_latitude<D>();
+        hd.begin = get_shape(*first_ptr).end_longitude<D>();
+        hd.end = get_shape(*second_ptr).begin_longitude<D>();
         hd.thickness = 1;
 
-        assert(hd.dir_loc >= first.rect.begin_latitude(dir));
-        assert(hd.dir_loc < first.rect.end_latitude(dir));
+        assert(hd.dir_loc >= first.rect.begin_latitude<D>());
+        assert(hd.dir_loc < first.rect.end_latitude<D>());
         assert(hd.begin <= hd.end);
 
         // Create space object.
@@ -327,14 +769,79 @@ class Dungeon {
         hall->data.hall = hd;
 
         // Collide with endpoints.
-        auto junc1 = proc_collision(hall, first_ptr, dir, hd.dir_loc);
-        auto junc2 = proc_collision(hall, second_ptr, dir, hd.dir_loc);
+        auto junc1 = proc_collision(hall, first_ptr, D, hd.dir_loc);
+        auto junc2 = proc_collision(hall, second_ptr, D, hd.dir_loc);
 
         return ArrayView<Space>(hall, hall + junc1.size() + junc2.size() + 1);
     }
 
+    // A split in progress. area is split along dir at pos into first and
+    // second, which are handed to carve, then replaced with what it made
+    // of them. carved counts the halves done, for carve_rooms().
+    struct SplitFrame {
+        AreaData area;
+        AreaData first;
+        AreaData second;
+        int depth = 0;
+        Dir dir = Dir::NONE;
+        int pos = 0;
+        uint32_t node_idx = 0;
+        int carved = 0;
+    };
+
+    // Splits in progress in carve_rooms(), innermost last.
+    // Sized by reserve_buffers(), so it doesn't allocate.
+    CountedVector<SplitFrame> carve_stack = CountedVector<SplitFrame>(counted<SplitFrame>());
+
     // Small function to avoid code duplication.
-    AreaData try_split_recurse(Dir split_dir, AreaData area, int const pos, int depth) {
+    // The halves are filled by carve(area, depth, half), half being 0 or 1.
+    template <typename Carve>
+    AreaData try_split_recurse(Dir split_dir, AreaData area, int const pos, int depth, Carve&& carve) {
+        SplitFrame f;
+        f.area = area;
+        f.depth = depth;
+        f.dir = split_dir;
+        f.pos = pos;
+        split_first(f);
+        f.first = carve(f.first, depth+1, 0);
+        split_second(f);
+        f.second = carve(f.second, depth+1, 1);
+        return split_join(f);
+    }
+
+    // The steps of a split, around the carving of its halves. Each
+    // dispatches on the direction once, so the split's rect and view math
+    // is compiled for each direction, and counts as the SPLIT phase.
+
+    // Adds the split's tree node and sets up f.first.
+    void split_first(SplitFrame& f) {
+        dungeon_stat_phase(SPLIT);
+        dispatch_dir(f.dir, [&](auto dir){
+            split_first_along<decltype(dir)::value>(f);
+        });
+    }
+
+    // Sets up f.second, once f.first is carved.
+    void split_second(SplitFrame& f) {
+        dungeon_stat_phase(SPLIT);
+        dispatch_dir(f.dir, [&](auto dir){
+            split_second_along<decltype(dir)::value>(f);
+        });
+    }
+
+    // Joins the carved halves with a hall, returning the carved area.
+    AreaData split_join(SplitFrame& f) {
+        dungeon_stat_phase(SPLIT);
+        return dispatch_dir(f.dir, [&](auto dir){
+            return split_join_along<decltype(dir)::value>(f);
+        });
+    }
+
+    template <Dir D>
+    void split_first_along(SplitFrame& f) {
+        AreaData& area = f.area;
+        int const pos = f.pos;
+
         // Make sure the caller is sane.
 
         assert(area.verify());
@@ -349,15 +856,15 @@ class Dungeon {
         assert(area.get_view(Cardinal::WEST).size() == area.rect.height());
         assert(area.get_view(Cardinal::EAST).size() == area.rect.height());
 
-        auto cards = get_cardinals(split_dir);
+        auto const cards = get_cardinals(D);
 
-        assert_if (split_dir == Dir::HORIZ) {
+        assert_if (D == Dir::HORIZ) {
             assert(cards.longitude.first == Cardinal::WEST);
             assert(cards.longitude.second == Cardinal::EAST);
             assert(cards.latitude.first == Cardinal::NORTH);
             assert(cards.latitude.second == Cardinal::SOUTH);
         }
-        assert_if (split_dir == Dir::VERT) {
+        assert_if (D == Dir::VERT) {
             assert(cards.latitude.first == Cardinal::WEST);
             assert(cards.latitude.second == Cardinal::EAST);
             assert(cards.longitude.first == Cardinal::NORTH);
@@ -365,57 +872,75 @@ class Dungeon {
         }
 
         assert(
-            pos > area.rect.begin_longitude(split_dir) &&
-            pos < area.rect.end_longitude(split_dir));
+            pos > area.rect.begin_longitude<D>() &&
+            pos < area.rect.end_longitude<D>());
 
-        assert(area.rect.width() >= room_width_min);
-        assert(area.rect.height() >= room_height_min);
+        assert(area.rect.width() >= config.room_width_min);
+        assert(area.rect.height() >= config.room_height_min);
 
         // Carve rooms in the two halves.
-        auto recurse_rects = area.rect.split(split_dir, pos);
+        pair<Rect,Rect> const recurse_rects = area.rect.split<D>(pos);
 
         assert(
-            recurse_rects.first.len_longitude(split_dir) +
-            recurse_rects.second.len_longitude(split_dir) ==
-            area.rect.len_longitude(split_dir));
-        assert(recurse_rects.first.len_latitude(split_dir) == area.rect.len_latitude(split_dir));
-        assert(recurse_rects.second.len_latitude(split_dir) == area.rect.len_latitude(split_dir));
+            recurse_rects.first.len_longitude<D>() +
+            recurse_rects.second.len_longitude<D>() ==
+            area.rect.len_longitude<D>());
+        assert(recurse_rects.first.len_latitude<D>() == area.rect.len_latitude<D>());
+        assert(recurse_rects.second.len_latitude<D>() == area.rect.len_latitude<D>());
 
-        assert(area.get_view(cards.longitude.first).size() == area.rect.len_latitude(split_dir));
-        assert(area.get_view(cards.longitude.second).size() == area.rect.len_latitude(split_dir));
+        assert(area.get_view(cards.longitude.first).size() == area.rect.len_latitude<D>());
+        assert(area.get_view(cards.longitude.second).size() == area.rect.len_latitude<D>());
 
-        auto first_cache = get_cache_view(area.rect.len_latitude(split_dir));
+        // The first half's subtree follows this node.
+        f.node_idx = push_tree_node(D, pos);
 
-        AreaData first_in;
+        AreaData& first_in = f.first;
+        first_in = AreaData{};
         first_in.rect = recurse_rects.first;
+        first_in.node = area.node*2;
         first_in.get_view(cards.longitude.first) = area.get_view(cards.longitude.first);
-        first_in.get_view(cards.longitude.second) = first_cache.view;
-        first_in.get_view(cards.latitude.first) = area.get_view(cards.latitude.first).slice(0,recurse_rects.first.len_longitude(split_dir));
-        first_in.get_view(cards.latitude.second) = area.get_view(cards.latitude.second).slice(0,recurse_rects.first.len_longitude(split_dir));
+        first_in.get_view(cards.longitude.second) = push_cache_view(area.rect.len_latitude<D>());
+        first_in.get_view(cards.latitude.first) = area.get_view(cards.latitude.first).slice(0,recurse_rects.first.len_longitude<D>());
+        first_in.get_view(cards.latitude.second) = area.get_view(cards.latitude.second).slice(0,recurse_rects.first.len_longitude<D>());
         assert(first_in.verify());
 
         assert(first_in.get_view(Cardinal::NORTH).size() == first_in.rect.width());
         assert(first_in.get_view(Cardinal::SOUTH).size() == first_in.rect.width());
         assert(first_in.get_view(Cardinal::WEST).size() == first_in.rect.height());
         assert(first_in.get_view(Cardinal::EAST).size() == first_in.rect.height());
+    }
+
+    template <Dir D>
+    void split_second_along(SplitFrame& f) {
+        AreaData const& area = f.area;
+        auto const cards = get_cardinals(D);
+        pair<Rect,Rect> const recurse_rects = area.rect.split<D>(f.pos);
 
-        auto first = carve_rooms(first_in, depth+1);
+        tree[f.node_idx].children[0] = f.node_idx + 1;
+        tree[f.node_idx].children[1] = uint32_t(tree.size());
 
-        auto second_cache = get_cache_view(area.rect.len_latitude(split_dir));
-        AreaData second_in;
+        AreaData& second_in = f.second;
+        second_in = AreaData{};
         second_in.rect = recurse_rects.second;
-        second_in.get_view(cards.longitude.first) = second_cache.view;
+        second_in.node = area.node*2 + 1;
+        second_in.get_view(cards.longitude.first) = push_cache_view(area.rect.len_latitude<D>());
         second_in.get_view(cards.longitude.second) = area.get_view(cards.longitude.second);
-        second_in.get_view(cards.latitude.first) = area.get_view(cards.latitude.first).slice(recurse_rects.first.len_longitude(split_dir));
-        second_in.get_view(cards.latitude.second) = area.get_view(cards.latitude.second).slice(recurse_rects.first.len_longitude(split_dir));
+        second_in.get_view(cards.latitude.first) = area.get_view(cards.latitude.first).slice(recurse_rects.first.len_longitude<D>());
+        second_in.get_view(cards.latitude.second) = area.get_view(cards.latitude.second).slice(recurse_rects.first.len_longitude<D>());
         assert(second_in.verify());
 
         assert(second_in.get_view(Cardinal::NORTH).size() == second_in.rect.width());
         assert(second_in.get_view(Cardinal::SOUTH).size() == second_in.rect.width());
         assert(second_in.get_view(Cardinal::WEST).size() == second_in.rect.height());
         assert(second_in.get_view(Cardinal::EAST).size() == second_in.rect.height());
+    }
 
-        auto second = carve_rooms(second_in, depth+1);
+    template <Dir D>
+    AreaData split_join_along(SplitFrame& f) {
+        AreaData& area = f.area;
+        AreaData& first = f.first;
+        AreaData& second = f.second;
+        auto const cards = get_cardinals(D);
 
         // Make sure carve_rooms() succeeded.
         assert(first.spaces.size() > 0);
@@ -426,7 +951,7 @@ class Dungeon {
         // Make sure first and second are valid.
 
         // Carve the hallway.
-        auto halls = carve_hallway(first, second, split_dir);
+        auto halls = carve_hallway<D>(first, second, area.node);
 
         // Verify that carve_hallway() succeeded/
         assert(halls.size() > 0);
@@ -445,20 +970,20 @@ class Dungeon {
             }
         }
 
-        auto comp_lat_begin = [&](auto const& a, auto const& b){
-            return a.begin_latitude(split_dir) <= b.begin_latitude(split_dir);
+        auto comp_lat_begin = [&](Rect const& a, Rect const& b){
+            return a.begin_latitude<D>() <= b.begin_latitude<D>();
         };
 
-        auto comp_lat_end = [&](auto const& a, auto const& b){
-            return a.end_latitude(split_dir) >= b.end_latitude(split_dir);
+        auto comp_lat_end = [&](Rect const& a, Rect const& b){
+            return a.end_latitude<D>() >= b.end_latitude<D>();
         };
 
-        auto comp_long_begin = [&](auto const& a, auto const& b){
-            return a.begin_longitude(split_dir) <= b.begin_longitude(split_dir);
+        auto comp_long_begin = [&](Rect const& a, Rect const& b){
+            return a.begin_longitude<D>() <= b.begin_longitude<D>();
         };
 
-        auto comp_long_end = [&](auto const& a, auto const& b){
-            return a.end_longitude(split_dir) >= b.end_longitude(split_dir);
+        auto comp_long_end = [&](Rect const& a, Rect const& b){
+            return a.end_longitude<D>() >= b.end_longitude<D>();
         };
 
         for (Space& sp : halls) {
@@ -470,11 +995,11 @@ class Dungeon {
                 }
                 assert(cur);
             };
-            for (int i : sp_rect.range_longitude(split_dir)) {
+            for (int i : sp_rect.range_longitude<D>()) {
                 check_assign(i,cards.latitude.first,comp_lat_begin);
                 check_assign(i,cards.latitude.second,comp_lat_end);
             }
-            for (int i : sp_rect.range_latitude(split_dir)) {
+            for (int i : sp_rect.range_latitude<D>()) {
                 check_assign(i,cards.longitude.first,comp_long_begin);
                 check_assign(i,cards.longitude.second,comp_long_end);
             }
@@ -487,10 +1012,18 @@ class Dungeon {
                 + second.spaces.size()
                 + halls.size());
 
+        tree[f.node_idx].space_begin = id_of(area.spaces.begin());
+        tree[f.node_idx].space_end = tree[f.node_idx].space_begin + SpaceId(area.spaces.size());
+
+        // The halves' views are done with, the second's being on top.
+        pop_cache_view(second.get_view(cards.longitude.first));
+        pop_cache_view(first.get_view(cards.longitude.second));
+
         assert(area.verify());
         return area;
     }
 
+
     struct SplitData {
         int min;
         int begin;
@@ -502,28 +1035,40 @@ class Dungeon {
         SplitData rv;
         rv.min = max(
             min_len + 1, // +1 to give room for hallways.
-            int(area_size * room_ratio_min));
+            config.times_ratio(area_size));
         rv.begin = begin + rv.min;
         rv.end = end - rv.min + 1;
         rv.range = rv.end - rv.begin;
         return rv;
     }
 
-    AreaData try_split(AreaData area, int const depth) {
-        int area_width = area.rect.end_c - area.rect.begin_c;
-        int area_height = area.rect.end_r - area.rect.begin_r;
+    // Rolls a split line for rect.
+    // Returns false if rect is too small to be split.
+    bool roll_split(Rect const& rect, uint64_t node, Dir& split_dir, int& split) {
+        dungeon_stat_count(split_attempts);
+        if (!pick_split(rect, node, split_dir, split)) {
+            dungeon_stat_count(split_failures);
+            return false;
+        }
+        return true;
+    }
+
+    // roll_split() without the stats, so that in counter mode, where
+    // rolling changes nothing either, it can run on any thread.
+    bool pick_split(Rect const& rect, uint64_t node, Dir& split_dir, int& split) {
+        int area_width = rect.end_c - rect.begin_c;
+        int area_height = rect.end_r - rect.begin_r;
 
-        auto vsplit = make_split_data(room_height_min, area_width, area.rect.begin_r, area.rect.end_r);
-        auto hsplit = make_split_data(room_width_min, area_height, area.rect.begin_c, area.rect.end_c);
+        auto vsplit = make_split_data(config.room_height_min, area_width, rect.begin_r, rect.end_r);
+        auto hsplit = make_split_data(config.room_width_min, area_height, rect.begin_c, rect.end_c);
 
         // If there's nowhere to split, we cannot create any rooms.
         if (vsplit.range + hsplit.range <= 0) { // TODO: can be equal to 0?
-            assert(area.verify());
-            return area;
+            return false;
         }
 
-        int split = roll_rng(0, vsplit.range + hsplit.range - 1);
-        Dir split_dir = Dir::VERT;
+        split = roll_rng(node, DRAW_SPLIT, 0, vsplit.range + hsplit.range - 1);
+        split_dir = Dir::VERT;
 
         if (split >= vsplit.range) {
             split_dir = Dir::HORIZ;
@@ -532,28 +1077,27 @@ class Dungeon {
             split += vsplit.begin;
         }
 
-        area = try_split_recurse(split_dir, area, split, depth);
-
-        assert(area.verify());
-        return area;
+        return true;
     }
 
     Rect make_room_rect(
         int min_long, int max_long,
         int min_lat, int max_lat,
         int center_long, int center_lat,
-        Dir free_dir
+        Dir free_dir, uint64_t node
     ) {
         auto roll_lat_len = roll_rng(
+            node, DRAW_ROOM_LAT,
             min_lat,
-            min(max_lat, int(max_long/room_ratio_min)));
+            min(max_lat, config.over_ratio(max_long)));
 
         const int lat_len = roll_lat_len;
         const int lat_pos = center_lat - lat_len/2;
 
-        auto min_long_len = int(lat_len * room_ratio_min);
+        auto min_long_len = config.times_ratio(lat_len);
 
         auto roll_long_len = roll_rng(
+            node, DRAW_ROOM_LONG,
             max(min_long,min_long_len),
             max_long);
 
@@ -569,7 +1113,7 @@ class Dungeon {
         return rd;
     }
 
-    Space make_room(Rect const rect) {
+    Space make_room(Rect const rect, uint64_t node) {
         const int area_width = rect.width() - 1; // -1 to give room for hallways.
         const int area_height = rect.height() - 1;
 
@@ -589,16 +1133,16 @@ class Dungeon {
         switch (free_dir) {
             case Dir::HORIZ: {
                 room.data.room = make_room_rect(
-                    room_width_min, area_width,
-                    room_height_min, area_height,
-                    center_c, center_r, free_dir);
+                    config.room_width_min, area_width,
+                    config.room_height_min, area_height,
+                    center_c, center_r, free_dir, node);
             } break;
 
             case Dir::VERT: {
                 room.data.room = make_room_rect(
-                    room_height_min, area_height,
-                    room_width_min, area_width,
-                    center_r, center_c, free_dir);
+                    config.room_height_min, area_height,
+                    config.room_width_min, area_width,
+                    center_r, center_c, free_dir, node);
             } break;
 
             default: {
@@ -614,203 +1158,1630 @@ class Dungeon {
         return room;
     }
 
-    AreaData carve_rooms(AreaData area, int depth) {
-        assert(area.verify());
-
-        assert(area.get_view(Cardinal::NORTH).size() == area.rect.width());
-        assert(area.get_view(Cardinal::SOUTH).size() == area.rect.width());
-        assert(area.get_view(Cardinal::WEST).size() == area.rect.height());
-        assert(area.get_view(Cardinal::EAST).size() == area.rect.height());
-
-        // Unless we're at the depth limit, try to split.
-        if (depth < depth_max) {
-            auto rv = try_split(area, depth);
-            assert(rv.verify());
-            if (!rv.spaces.empty()) {
-                return rv;
-            }
-        }
-
-        // We've failed to split, so just make a single room.
-        auto room = add_space(make_room(area.rect));
-
-        for (int i : number_range(room->data.room.begin_c,room->data.room.end_c)) {
-            area.view_from(Cardinal::NORTH,i) = room;
-            area.view_from(Cardinal::SOUTH,i) = room;
+    // Makes area the single room leaf(area).
+    template <typename Leaf>
+    AreaData carve_leaf(AreaData area, Leaf& leaf) {
+        dungeon_stat_phase(ROOMS);
+        auto room = add_space(leaf(area));
+        auto const& rr = room->data.room;
+
+        // Every entry is written, as the views aren't cleared beforehand.
+        for (int i : number_range(area.rect.begin_c,area.rect.end_c)) {
+            Space* sp = (i >= rr.begin_c && i < rr.end_c ? room : nullptr);
+            area.view_from(Cardinal::NORTH,i) = sp;
+            area.view_from(Cardinal::SOUTH,i) = sp;
         }
 
-        for (int i : number_range(room->data.room.begin_r,room->data.room.end_r)) {
-            area.view_from(Cardinal::WEST,i) = room;
-            area.view_from(Cardinal::EAST,i) = room;
+        for (int i : number_range(area.rect.begin_r,area.rect.end_r)) {
+            Space* sp = (i >= rr.begin_r && i < rr.end_r ? room : nullptr);
+            area.view_from(Cardinal::WEST,i) = sp;
+            area.view_from(Cardinal::EAST,i) = sp;
         }
 
         area.spaces = ArrayView<Space>(room,room+1);
 
+        auto node_idx = push_tree_node(Dir::NONE, 0);
+        tree[node_idx].space_begin = id_of(room);
+        tree[node_idx].space_end = id_of(room) + 1;
+
         assert(area.verify());
         return area;
     }
 
-    Space* add_space(Space sp) {
-        if (rooms.size() == rooms.capacity()) {
-            throw logic_error("Need more space for rooms!");
+    // Carves area, splitting it until the depth limit or until it can't
+    // be split, and making a room of every leaf.
+    AreaData carve_rooms(AreaData area, int depth) {
+        auto split = [this](AreaData const& a, int d, Dir& dir, int& pos){
+            if (d >= config.depth_max) {
+                return false;
+            }
+            dungeon_stat_phase(SPLIT);
+            return roll_split(a.rect, a.node, dir, pos);
+        };
+        auto leaf = [this](AreaData const& a){
+            return make_room(a.rect, a.node);
+        };
+        return carve_tree(area, depth, split, leaf);
+    }
+
+    // Carves area with split(area, depth, dir, pos) deciding on every node,
+    // in preorder, whether and where it's split, and leaf(area) making the
+    // room of every node that isn't.
+    // Splits wait on carve_stack while their halves are carved, the first
+    // before the second, so spaces, tree nodes and draws come in the same
+    // order as if each half were carved by a call of its own.
+    template <typename Split, typename Leaf>
+    AreaData carve_tree(AreaData area, int depth, Split& split, Leaf& leaf) {
+        auto const base = carve_stack.size();
+
+        while (true) {
+            assert(area.verify());
+
+            assert(area.get_view(Cardinal::NORTH).size() == area.rect.width());
+            assert(area.get_view(Cardinal::SOUTH).size() == area.rect.width());
+            assert(area.get_view(Cardinal::WEST).size() == area.rect.height());
+            assert(area.get_view(Cardinal::EAST).size() == area.rect.height());
+
+            dungeon_stat_max(max_depth, depth);
+
+            // Try to split, and carve the first half next.
+            SplitFrame f;
+            if (split(area, depth, f.dir, f.pos)) {
+                f.area = area;
+                f.depth = depth;
+                carve_stack.push_back(f);
+                split_first(carve_stack.back());
+                area = carve_stack.back().first;
+                ++depth;
+                continue;
+            }
+
+            // We've failed to split, so just make a single room.
+            area = carve_leaf(area, leaf);
+
+            // Join every split with both halves carved, up to one with its
+            // second half left to carve.
+            while (carve_stack.size() > base) {
+                auto& f = carve_stack.back();
+                if (f.carved == 0) {
+                    f.first = area;
+                    f.carved = 1;
+                    split_second(f);
+                    area = f.second;
+                    depth = f.depth + 1;
+                    break;
+                }
+                f.second = area;
+                area = split_join(f);
+                carve_stack.pop_back();
+            }
+
+            if (carve_stack.size() == base) {
+                return area;
+            }
         }
-        rooms.push_back(move(sp));
-        return &rooms.back();
     }
 
-public:
+    // Splits the top of the tree, recording a job for every subtree
+    // that is left to be carved.
+    int plan_subtree(Rect const& rect, uint64_t node, int depth) {
+        int idx = plan.size();
+        plan.push_back(SplitPlan{});
+        plan[idx].rect = rect;
+
+        Dir split_dir;
+        int split;
+
+        if (depth <= parallel_depth && depth < config.depth_max && roll_split(rect, node, split_dir, split)) {
+            auto halves = rect.split(split_dir, split);
+            int first = plan_subtree(halves.first, node*2, depth+1);
+            int second = plan_subtree(halves.second, node*2 + 1, depth+1);
+            plan[idx].dir = split_dir;
+            plan[idx].pos = split;
+            plan[idx].children[0] = first;
+            plan[idx].children[1] = second;
+        } else {
+            plan[idx].job = jobs.size();
+            jobs.push_back(SubtreeJob{rect, depth, node, rng()});
+        }
 
-    template <typename T>
-    void seed(T s) {
-        rng.seed(s);
+        return idx;
     }
 
-    void go(int w, int h) {
-        if (w <= room_width_min || h <= room_width_min) {
-			throw logic_error("Dungeon::go(): Dungeon is too small to create any rooms!");
-		}
+    // Sizes every buffer for carving a w by h area from depth, with
+    // cache_size entries of cache (see max_cache()).
+    // Buffers only ever grow, so later calls for the same or a smaller
+    // area don't allocate.
+    void reserve_buffers(int w, int h, int depth, size_t cache_size) {
+        rooms.clear();
+        auto spaces = max_spaces(w, h, depth);
+        rooms.reserve(rooms_reserve_max > 0 ? min(spaces, rooms_reserve_max) : spaces);
+        auto cap = rooms.capacity();
 
-        width = w;
-        height = h;
+        clear_edges();
+        edge_lists.reserve(cap);
+        edge_nodes.reserve(cap * max_edges_per_space);
+        edge_offsets.reserve(cap + 1);
+        edge_targets.reserve(cap * max_edges_per_space);
 
-        auto intpow = [](int a, int e){
-            int rv = 1;
-            for (int i=0; i<e; ++i) {
-                rv *= a;
-            }
-            return rv;
-        };
+        table.reserve(cap);
 
-        auto cap = intpow(2,depth_max-1) * 4 - 3;
+        tree.clear();
+        tree.reserve(max_leaves(w, h, depth) * 2 - 1);
 
-        rooms.clear();
-        rooms.reserve(cap);
+        // Every split nested in another leaves room for a split's halves,
+        // at least room_*_min+1 long, so the area runs out before long.
+        auto const nesting = size_t(w / (config.room_width_min+1) + h / (config.room_height_min+1));
+        carve_stack.clear();
+        carve_stack.reserve(min(size_t(max(config.depth_max - depth, 0)), nesting) + 1);
+
+        auto border_size = size_t(w*2 + h*2);
+        bool const own_cache = (cache_size > 0 && cache_size <= cache_storage.size());
 
+        scratch.reset(
+            (own_cache ? 0 : MonotonicArena::footprint<Space*>(cache_size)) +
+            MonotonicArena::footprint<Space*>(border_size));
+
+        auto cache_mem = (own_cache ? cache_storage.data() : scratch.allocate<Space*>(cache_size));
+        cache = ArrayView<Space*>(cache_mem, cache_size);
         cache_pos = 0;
-        cache.resize(max(width,height)*(depth_max-1)*2);
 
-        vector<Space*> mem (width*2 + height*2, nullptr);
-        AreaData data;
-        data.rect = Rect{0, height, 0, width};
-        data.bind_to(ArrayView<Space*>(&mem[0],&mem[mem.size()]));
+        border = ArrayView<Space*>(scratch.allocate<Space*>(border_size), border_size);
+    }
 
-        auto all = carve_rooms(data, 1);
+    AreaData bind_area(Rect const& rect) {
+        auto mem = border.slice(0, rect.width()*2 + rect.height()*2);
 
-        assert(&*all.spaces.begin() == &*rooms.begin());
+        AreaData data;
+        data.rect = rect;
+        data.bind_to(mem);
+        return data;
+    }
 
-        assert(rooms.capacity() == cap);
+    // Most cache a carve from depth can use at once, for any area at that
+    // depth of a w by h map. It only grows with w and h, so later calls on
+    // smaller maps fit in the same scratch memory.
+    // Every split on the way down to a leaf holds up to two views as long as
+    // the rect is wide across the split line. A VERT split takes at least
+    // room_height_min+1 rows off both halves, so a path has at most
+    // h/(room_height_min+1)-1 of them, each as wide as w at most, and no
+    // wider than max_side_for_split(h) lets a rect be and still split;
+    // likewise HORIZ splits with columns. This takes the costliest mix of
+    // the two that fits in the levels from depth down.
+    size_t max_cache(int w, int h, int depth) const {
+        auto const levels = size_t(max(config.depth_max - max(depth, 1), 0));
+
+        auto const vert_n = size_t(max(h / (config.room_height_min+1) - 1, 0));
+        auto const vert_len = size_t(min(w, max_side_for_split(h)));
+        auto const horiz_n = size_t(max(w / (config.room_width_min+1) - 1, 0));
+        auto const horiz_len = size_t(min(h, max_side_for_split(w)));
+
+        // Costlier splits first, as many as can be on one path.
+        auto const first_n = (vert_len >= horiz_len ? vert_n : horiz_n);
+        auto const first_len = max(vert_len, horiz_len);
+        auto const second_n = (vert_len >= horiz_len ? horiz_n : vert_n);
+        auto const second_len = min(vert_len, horiz_len);
+
+        auto const n1 = min(first_n, levels);
+        auto const n2 = min(second_n, levels - n1);
+        return (n1 * first_len + n2 * second_len) * 2;
     }
 
-    template <typename Out>
-    void print_dot(Out& out) {
-        out << "graph g {" << endl;
-        for (Space& s : rooms) {
-            Space* sp = &s;
-            auto rect = get_shape(s);
-            out << "    " << intptr_t(sp) << " ["
-                << "label=\""
-                    << (s.type==SpaceType::ROOM? "Room " : "Hall ")
-                    << rect.begin_r << "-" << rect.end_r << ":"
-                    << rect.begin_c << "-" << rect.end_c << "\" "
-                << "pos=\""
-                    << ((rect.begin_c+rect.end_c)*72/2) << ","
-                    << ((rect.begin_r+rect.end_r)*72/2) << "\" "
-                << "];" << endl;
-            for (Space* sp2 : s.neighbors) {
-                if (less<void>{}(sp, sp2)) {
-                    out << "    " << intptr_t(sp) << " -- " << intptr_t(sp2) << ";" << endl;
-                }
-            }
+    // Widest side across a split that still leaves len for the halves,
+    // given that each half needs int(side * room_ratio_min).
+    int max_side_for_split(int len) const {
+        if (config.room_ratio_min <= 0) {
+            return numeric_limits<int>::max();
         }
-        out << "}" << endl;
+        auto rv = config.over_ratio(len/2 + 1);
+        while (rv > 0 && config.times_ratio(rv) > len/2) {
+            --rv;
+        }
+        while (config.times_ratio(rv+1) <= len/2) {
+            ++rv;
+        }
+        return rv;
     }
 
-    void sub(int x) {
-        width = width - x;
-        height = height - x;
-        for (Space& sp : rooms) {
-            switch (sp.type) {
-                case SpaceType::ROOM: {
-                    sp.data.room.end_r -= x;
-                    sp.data.room.end_c -= x;
-                } break;
-
-                case SpaceType::HALL: {
-                    sp.data.hall.begin -= x;
-                    sp.data.hall.thickness -= x;
-                } break;
-
-                default: {
-                    throw logic_error("Invalid room detected!");
-                }
-            }
-        }
+    // Upper bound on the leaves of a w by h area carved from depth.
+    // Both halves of a split are at least room_*_min+1 long (more if
+    // room_ratio_min asks for it), so there can't be more leaves than cells
+    // of that size fit in the area, nor more than a full tree has.
+    size_t max_leaves(int w, int h, int depth) const {
+        int const min_w = config.room_width_min + 1;
+        int const min_h = config.room_height_min + 1;
+
+        int const cell_w = max(min_w, config.times_ratio(min(h,min_h)));
+        int const cell_h = max(min_h, config.times_ratio(min(w,min_w)));
+
+        auto cells = size_t(max(1, w / cell_w)) * size_t(max(1, h / cell_h));
+        auto full = size_t(1) << min(max(config.depth_max - depth, 0), 40);
+
+        return min(cells, full);
     }
 
-    void mult(int x) {
-        width = width*x - x + 1;
-        height = height*x - x + 1;
-        for (Space& sp : rooms) {
-            switch (sp.type) {
-                case SpaceType::ROOM: {
-                    sp.data.room.begin_r *= x;
-                    sp.data.room.begin_c *= x;
-                    sp.data.room.end_r *= x;
-                    sp.data.room.end_c *= x;
-                } break;
-
-                case SpaceType::HALL: {
-                    sp.data.hall.begin *= x;
-                    sp.data.hall.end *= x;
-                    sp.data.hall.dir_loc *= x;
-                    sp.data.hall.thickness *= x;
-                } break;
-
-                default: {
-                    throw logic_error("Invalid room detected!");
-                }
+    // Spaces expected for a w by h area carved from depth.
+    // Halls ending in halls add junctions, so this isn't a hard limit;
+    // carve_with_retry() grows rooms when it's exceeded.
+    size_t max_spaces(int w, int h, int depth) const {
+        return max_leaves(w, h, depth) * 4 - 3;
+    }
+
+    // Thrown by add_space() when rooms is full.
+    // Spaces are referenced by pointer while carving, so rooms can't grow
+    // in place; the carve is restarted with a bigger buffer instead.
+    struct RoomsFull {};
+
+    // Runs carve() until rooms is big enough for it. rng and stats are
+    // rewound before every retry, so neither the result nor what it counts
+    // depends on the number of tries, apart from retries itself.
+    template <typename Carve>
+    AreaData carve_with_retry(int w, int h, int depth, size_t cache_size, Carve&& carve) {
+        auto const saved_rng = rng;
+        auto const saved_stats = stats;
+        reserve_buffers(w, h, depth, cache_size);
+        while (true) {
+            try {
+                return carve();
+            } catch (RoomsFull const&) {
+                auto const retries = stats.retries;
+                stats = saved_stats;
+                stats.retries = retries;
+                dungeon_stat_count(retries);
+                rng = saved_rng;
+                rooms.reserve(rooms.capacity() * 2);
+                reserve_buffers(w, h, depth, cache_size);
             }
         }
     }
 
-    int num_cols() const {
-        return width;
+    // Runs on a job dungeon, for go_region() and reroll().
+    // Buffers are sized for the chunk alone, as chunks are small and there
+    // may be many of them. Every split below holds two views at most as
+    // long as the chunk's longer side.
+    AreaData carve_chunk(SubtreeJob const& job) {
+        stats = DungeonStats{};
+        dungeon_stat_phase(OTHER);
+        rng.seed(job.seed);
+        int const w = job.rect.width();
+        int const h = job.rect.height();
+        auto const cache_size = size_t(max(w,h)) * 2 * size_t(max(config.depth_max - job.depth, 0));
+        return carve_with_retry(w, h, job.depth, cache_size, [&]{
+            auto area = bind_area(job.rect);
+            area.node = job.node;
+            return carve_rooms(area, job.depth);
+        });
     }
 
-    int num_rows() const {
-        return height;
+    // Runs on a job dungeon.
+    // Buffers are sized for the whole w by h dungeon so that they fit any job.
+    AreaData carve_subtree(SubtreeJob const& job, int w, int h) {
+        stats = DungeonStats{};
+        dungeon_stat_phase(OTHER);
+        rng.seed(job.seed);
+        return carve_with_retry(w, h, job.depth, max_cache(w, h, job.depth), [&]{
+            auto area = bind_area(job.rect);
+            area.node = job.node;
+            return carve_rooms(area, job.depth);
+        });
     }
 
-    SpaceVec const& get_spaces() const {
-        return rooms;
+    // Carves every job with carve(job_dungeon, job), on the workers if any.
+    template <typename Carve>
+    void run_jobs(Carve&& carve) {
+        for (int i : number_range(0,int(jobs.size()))) {
+            job_dungeons[i]->set_params(get_params());
+            job_dungeons[i]->counter_rng = counter_rng;
+            job_dungeons[i]->seed_value = seed_value;
+        }
+
+        auto run = [this,&carve](int i){
+            return carve(*job_dungeons[i], jobs[i]);
+        };
+
+        job_results.resize(jobs.size());
+
+        if (!workers) {
+            for (int i : number_range(0,int(jobs.size()))) {
+                job_results[i] = run(i);
+            }
+            return;
+        }
+
+        // Waiting on the results lets this thread carve jobs too.
+        job_futures.clear();
+        for (int i : number_range(0,int(jobs.size()))) {
+            job_futures.push_back(workers->do_task(run, i));
+        }
+        for (int i : number_range(0,int(jobs.size()))) {
+            job_results[i] = job_futures[i].get();
+        }
+        job_futures.clear();
     }
 
-    vector<string> print_tiles() const {
-        auto line = string(num_cols(), '#');
-        vector<string> tiles (num_rows(), line);
-        for (auto sp : get_spaces()) {
-            auto rect = get_shape(sp);
-            for (int r=rect.begin_r; r<rect.end_r; ++r) {
-                for (int c=rect.begin_c; c<rect.end_c; ++c) {
-                    switch (sp.type) {
-                        case SpaceType::ROOM: {
-                            tiles[r][c] = '.';
-                        } break;
-
-                        case SpaceType::HALL: {
-                            switch (sp.data.hall.dir) {
-                                case Dir::HORIZ: {
-                                    tiles[r][c] = '-';
-                                } break;
-                                case Dir::VERT: {
-                                    tiles[r][c] = '|';
-                                } break;
-                            }
-                        } break;
+    void merge_job_stats() {
+        for (int i : number_range(0,int(jobs.size()))) {
+            auto job = job_dungeons[i]->stats;
+            job.spaces_added = 0; // Counted again by splice_job().
+            stats.merge(job);
+        }
+    }
+
+    // Copies a finished job's split tree to the end of tree, for spaces
+    // spliced next.
+    void splice_tree(int job) {
+        BasicDungeon& jd = *job_dungeons[job];
+
+        auto const node_base = uint32_t(tree.size());
+        auto const space_base = SpaceId(rooms.size());
+        for (SplitNode n : jd.tree) {
+            if (n.dir != Dir::NONE) {
+                n.children[0] += node_base;
+                n.children[1] += node_base;
+            }
+            n.space_begin += space_base;
+            n.space_end += space_base;
+            tree.push_back(n);
+        }
+    }
+
+    // Copies a finished job's spaces and edges to the end of rooms,
+    // returning where they start.
+    Space* splice_spaces(int job) {
+        BasicDungeon& jd = *job_dungeons[job];
+
+        Space* base = rooms.data() + rooms.size();
+
+        for (Space& sp : jd.rooms) {
+            add_space(sp);
+        }
+
+        auto base_id = id_of(base);
+        for (SpaceId i : number_range(SpaceId(0),SpaceId(jd.rooms.size()))) {
+            for (auto e = jd.edge_lists[i].head; e != no_edge; e = jd.edge_nodes[e].next) {
+                add_edge(base_id + i, base_id + jd.edge_nodes[e].to);
+            }
+        }
+
+        return base;
+    }
+
+    // Moves a finished job into rooms, in place of carving area.
+    AreaData splice_job(AreaData area, int job) {
+        BasicDungeon& jd = *job_dungeons[job];
+        AreaData const& res = job_results[job];
+
+        assert(area.rect == res.rect);
+
+        Space* job_base = jd.rooms.data();
+        splice_tree(job);
+        Space* base = splice_spaces(job);
+
+        auto rebase = [&](Space* sp) -> Space* {
+            return (sp ? base + (sp - job_base) : nullptr);
+        };
+
+        for (int v : number_range(0,4)) {
+            assert(area.views[v].size() == res.views[v].size());
+            for (int i : number_range(0,int(res.views[v].size()))) {
+                area.views[v][i] = rebase(res.views[v][i]);
+            }
+        }
+
+        area.spaces = ArrayView<Space>(base, base + jd.rooms.size());
+
+        assert(area.verify());
+        return area;
+    }
+
+    AreaData merge_plan(AreaData area, int idx, int depth) {
+        SplitPlan const& node = plan[idx];
+
+        if (node.job >= 0) {
+            return splice_job(area, node.job);
+        }
+
+        return try_split_recurse(node.dir, area, node.pos, depth, [&](AreaData half, int d, int which){
+            return merge_plan(half, node.children[which], d);
+        });
+    }
+
+    AreaData carve_parallel(AreaData area) {
+        auto max_jobs = size_t(intpow(2,parallel_depth));
+
+        plan.clear();
+        plan.reserve(max_jobs*2 - 1);
+        jobs.clear();
+        jobs.reserve(max_jobs);
+        job_results.reserve(max_jobs);
+        job_futures.reserve(max_jobs);
+
+        while (job_dungeons.size() < max_jobs) {
+            job_dungeons.push_back(make_unique<BasicDungeon>());
+            counter.count(sizeof(BasicDungeon));
+        }
+
+        plan_subtree(area.rect, area.node, 1);
+        run_jobs([this](BasicDungeon& jd, SubtreeJob const& job){
+            return jd.carve_subtree(job, width, height);
+        });
+        merge_job_stats();
+
+        return merge_plan(area, 0, 1);
+    }
+
+    // Level generation, see go_levels().
+    // The split tree is decided a level at a time into a struct of arrays,
+    // each level after the one before it: node i has rect, id, and either a
+    // split (dir and pos, its halves being nodes children[i] and
+    // children[i]+1 of the next level) or, once every level is done, a room.
+
+    CountedVector<Rect> level_rects = CountedVector<Rect>(counted<Rect>());
+    CountedVector<uint64_t> level_ids = CountedVector<uint64_t>(counted<uint64_t>());
+    CountedVector<Dir> level_dirs = CountedVector<Dir>(counted<Dir>());
+    CountedVector<int> level_pos = CountedVector<int>(counted<int>());
+    CountedVector<uint32_t> level_children = CountedVector<uint32_t>(counted<uint32_t>());
+    CountedVector<Rect> level_rooms = CountedVector<Rect>(counted<Rect>());
+
+    // Second halves left to carve while walking the levels in preorder.
+    CountedVector<uint32_t> level_pending = CountedVector<uint32_t>(counted<uint32_t>());
+
+    // Batches smaller than this run on the calling thread.
+    static constexpr uint32_t batch_min = 256;
+
+    // Calls f(i) for every i in [begin,end), split into chunks on the
+    // workers if there are any. f must be safe to call concurrently.
+    template <typename F>
+    void run_batch(uint32_t begin, uint32_t end, F const& f) {
+        auto const n = end - begin;
+        if (!workers || workers->size() == 0 || n < batch_min*2) {
+            for (auto i : number_range(begin, end)) {
+                f(i);
+            }
+            return;
+        }
+
+        auto const chunks = min(workers->size()*4, n / batch_min);
+        job_futures.clear();
+        job_futures.reserve(chunks);
+        for (auto c : number_range(0u, chunks)) {
+            auto const b = begin + uint32_t(uint64_t(n) * c / chunks);
+            auto const e = begin + uint32_t(uint64_t(n) * (c+1) / chunks);
+            job_futures.push_back(workers->do_task([&f, b, e]{
+                for (auto i : number_range(b, e)) {
+                    f(i);
+                }
+                return AreaData{};
+            }));
+        }
+        for (auto& fut : job_futures) {
+            fut.get();
+        }
+        job_futures.clear();
+    }
+
+    // Decides the whole split tree of rect, a level per batch of splits,
+    // then every room in one batch.
+    void plan_levels(Rect const& rect) {
+        auto const cap = max_leaves(width, height, 1) * 2 - 1;
+        level_rects.clear();
+        level_rects.reserve(cap);
+        level_ids.clear();
+        level_ids.reserve(cap);
+        level_dirs.reserve(cap);
+        level_pos.reserve(cap);
+        level_children.reserve(cap);
+        level_rooms.reserve(cap);
+        level_pending.reserve(config.depth_max);
+
+        level_rects.push_back(rect);
+        level_ids.push_back(1);
+
+        uint32_t begin = 0;
+        for (int depth = 1; begin < level_rects.size(); ++depth) {
+            auto const end = uint32_t(level_rects.size());
+            level_dirs.resize(end);
+            level_pos.resize(end);
+            level_children.resize(end);
+
+            if (depth < config.depth_max) {
+                dungeon_stat_phase(SPLIT);
+                run_batch(begin, end, [&](uint32_t i){
+                    level_dirs[i] = Dir::NONE;
+                    pick_split(level_rects[i], level_ids[i], level_dirs[i], level_pos[i]);
+                });
+            } else {
+                fill(level_dirs.begin() + begin, level_dirs.end(), Dir::NONE);
+            }
+
+            // The halves make up the next level, in the order of their splits.
+            for (auto i : number_range(begin, end)) {
+                if (depth < config.depth_max) {
+                    dungeon_stat_count(split_attempts);
+                }
+                if (level_dirs[i] == Dir::NONE) {
+                    if (depth < config.depth_max) {
+                        dungeon_stat_count(split_failures);
                     }
+                    continue;
+                }
+                auto halves = level_rects[i].split(level_dirs[i], level_pos[i]);
+                level_children[i] = uint32_t(level_rects.size());
+                level_rects.push_back(halves.first);
+                level_rects.push_back(halves.second);
+                level_ids.push_back(level_ids[i]*2);
+                level_ids.push_back(level_ids[i]*2 + 1);
+            }
+
+            begin = end;
+        }
+
+        dungeon_stat_phase(ROOMS);
+        level_rooms.resize(level_rects.size());
+        run_batch(0, uint32_t(level_rects.size()), [&](uint32_t i){
+            if (level_dirs[i] == Dir::NONE) {
+                level_rooms[i] = make_room(level_rects[i], level_ids[i]).data.room;
+            }
+        });
+    }
+
+    // Carves the tree plan_levels() decided, in preorder, adding the halls.
+    AreaData carve_levels(AreaData area) {
+        uint32_t cur = 0;
+        uint32_t next = 0;
+        level_pending.clear();
+
+        auto split = [&](AreaData const& a, int, Dir& dir, int& pos){
+            cur = next;
+            assert(a.node == level_ids[cur]);
+            (void)a;
+            dir = level_dirs[cur];
+            pos = level_pos[cur];
+            if (dir == Dir::NONE) {
+                if (!level_pending.empty()) {
+                    next = level_pending.back();
+                    level_pending.pop_back();
+                }
+                return false;
+            }
+            next = level_children[cur];
+            level_pending.push_back(next + 1);
+            return true;
+        };
+        auto leaf = [&](AreaData const&){
+            Space room;
+            room.type = SpaceType::ROOM;
+            room.data.room = level_rooms[cur];
+            return room;
+        };
+
+        return carve_tree(area, 1, split, leaf);
+    }
+
+    // Region generation, see go_region().
+    // Nodes outside the query are never split. Nodes in it that are at most
+    // region_chunk wide and high, or can't be split, are chunks, carved as
+    // jobs just like carve_rooms() carves them in counter mode. A split
+    // above the chunks has a corridor along the free margin of its first
+    // half instead of a hall, so that nothing about it depends on how far
+    // its halves are expanded.
+
+    int region_chunk = 64;
+
+    CountedVector<RegionNode> region_nodes = CountedVector<RegionNode>(counted<RegionNode>());
+
+    int plan_region(Rect const& rect, uint64_t node, int depth, int parent, Rect const& query) {
+        int idx = region_nodes.size();
+        region_nodes.push_back(RegionNode{});
+        region_nodes[idx].rect = rect;
+        region_nodes[idx].node = node;
+        region_nodes[idx].depth = depth;
+        region_nodes[idx].parent = parent;
+
+        if (!rect.intersects(query)) {
+            return idx;
+        }
+
+        Dir split_dir;
+        int split;
+
+        bool const big = max(rect.width(), rect.height()) > region_chunk;
+
+        if (big && depth < config.depth_max && roll_split(rect, node, split_dir, split)) {
+            auto halves = rect.split(split_dir, split);
+            int first = plan_region(halves.first, node*2, depth+1, idx, query);
+            int second = plan_region(halves.second, node*2 + 1, depth+1, idx, query);
+            region_nodes[idx].dir = split_dir;
+            region_nodes[idx].pos = split;
+            region_nodes[idx].children[0] = first;
+            region_nodes[idx].children[1] = second;
+        } else {
+            region_nodes[idx].chunk = jobs.size();
+            jobs.push_back(SubtreeJob{rect, depth, node, {}});
+        }
+
+        return idx;
+    }
+
+    // Nearest ancestor of idx split in dir at pos, or -1.
+    int region_splitter(int idx, Dir dir, int pos) const {
+        for (int a = region_nodes[idx].parent; a >= 0; a = region_nodes[a].parent) {
+            if (region_nodes[a].dir == dir && region_nodes[a].pos == pos) {
+                return a;
+            }
+        }
+        return -1;
+    }
+
+    // The corridor runs the length of the split line, one tile into the
+    // first half, and stops short of the corridors of the splits bounding
+    // the node, which it is linked to.
+    void add_corridor(int idx) {
+        auto& rn = region_nodes[idx];
+
+        HallData hd;
+        hd.dir = flip(rn.dir);
+        hd.dir_loc = rn.pos - 1;
+        hd.begin = rn.rect.begin_longitude(hd.dir);
+        hd.end = rn.rect.end_longitude(hd.dir) - 1;
+        hd.thickness = 1;
+
+        auto hall = add_space(Space{});
+        hall->type = SpaceType::HALL;
+        hall->data.hall = hd;
+        rn.corridor = int(id_of(hall));
+
+        for (int pos : {hd.begin, hd.end + 1}) {
+            int a = region_splitter(idx, hd.dir, pos);
+            if (a >= 0) {
+                link(hall, &rooms[region_nodes[a].corridor]);
+            }
+        }
+    }
+
+    // Whether the walk from ancestor a's half towards the side car of it
+    // ends at idx. It takes the half touching car at splits across car and
+    // draws one at splits along it.
+    bool region_walk_ends_at(int idx, int a, Cardinal car) {
+        Dir const dir = region_nodes[a].dir;
+        for (int n = idx; region_nodes[n].parent != a; n = region_nodes[n].parent) {
+            auto const& p = region_nodes[region_nodes[n].parent];
+            if (p.dir != dir) {
+                int which = roll_rng(p.node, Draw(DRAW_REGION_EDGE + int(car)), 0, 1);
+                if (p.children[which] != n) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Connects the chunk's side car to corridor, at a position drawn from
+    // where the chunk has spaces along that side. The hall goes from the
+    // nearest space to the corridor, which is either on the chunk's edge or
+    // just past it.
+    void link_chunk_side(int idx, Space* base, Cardinal car, Space* corridor) {
+        auto const& rn = region_nodes[idx];
+        auto const& view = job_results[rn.chunk].get_view(car);
+        Dir const dir = car2dir(car);
+        bool const to_end = (car == get_cardinals(dir).longitude.second);
+
+        auto bounds = find_partition_bounds(begin(view), end(view), is_null);
+        int a = bounds.first - begin(view);
+        int b = bounds.second - begin(view);
+        assert(b-a > 0);
+
+        int loc = rn.rect.begin_latitude(dir) + roll_rng(rn.node, Draw(DRAW_REGION_LINK + int(car)), a, b-1);
+
+        // Scanning finds halls already linked to other sides too.
+        Space* nearest = nullptr;
+        for (Space* sp = base; sp != rooms.data() + rooms.size(); ++sp) {
+            auto shape = get_shape(*sp);
+            if (loc < shape.begin_latitude(dir) || loc >= shape.end_latitude(dir)) {
+                continue;
+            }
+            if (!nearest || (to_end ?
+                    shape.end_longitude(dir) > get_shape(*nearest).end_longitude(dir) :
+                    shape.begin_longitude(dir) < get_shape(*nearest).begin_longitude(dir))) {
+                nearest = sp;
+            }
+        }
+        assert(nearest);
+
+        auto shape = get_shape(*nearest);
+
+        HallData hd;
+        hd.dir = dir;
+        hd.dir_loc = loc;
+        hd.begin = (to_end ? shape.end_longitude(dir) : rn.rect.begin_longitude(dir));
+        hd.end = (to_end ? rn.rect.end_longitude(dir) - 1 : shape.begin_longitude(dir));
+        hd.thickness = 1;
+
+        assert(hd.begin <= hd.end);
+
+        if (hd.begin == hd.end) {
+            proc_collision(corridor, nearest, dir, loc);
+            return;
+        }
+
+        auto hall = add_space(Space{});
+        hall->type = SpaceType::HALL;
+        hall->data.hall = hd;
+
+        proc_collision(hall, nearest, dir, loc);
+        link(hall, corridor);
+    }
+
+    // Splices chunk idx and links it to the corridors of the splits it was
+    // walked to, deepest first.
+    void add_chunk(int idx) {
+        auto const root = uint32_t(tree.size());
+        splice_tree(region_nodes[idx].chunk);
+        Space* base = splice_spaces(region_nodes[idx].chunk);
+        Rect const rect = region_nodes[idx].rect;
+
+        for (int a = region_nodes[idx].parent; a >= 0; a = region_nodes[a].parent) {
+            auto const& split = region_nodes[a];
+            auto cards = get_cardinals(split.dir);
+            bool const first = (rect.end_longitude(split.dir) <= split.pos);
+            if (first ? rect.end_longitude(split.dir) != split.pos : rect.begin_longitude(split.dir) != split.pos) {
+                continue;
+            }
+            auto car = (first ? cards.longitude.second : cards.longitude.first);
+            if (region_walk_ends_at(idx, a, car)) {
+                link_chunk_side(idx, base, car, &rooms[split.corridor]);
+            }
+        }
+
+        tree[root].space_end = SpaceId(rooms.size());
+    }
+
+    // Rerolling, see reroll().
+    // Only the halls and junctions of a node's ancestors reach into it, so
+    // only those need repair, and only the new subtree's spaces need to be
+    // looked at for it.
+
+    // Set by go(), as go_region() and transform() leave a tree whose
+    // splits aren't where carving put them.
+    bool can_reroll = false;
+
+    // What reroll() does to one of the ancestors' spaces, of which only
+    // halls move. A new end is the job dungeon space the hall runs into, and
+    // the longitude of the tile it meets there, for finding the piece there
+    // once that space may have been split by a junction.
+    struct HallRepair {
+        SpaceId hall;
+        uint32_t owner;          // Tree node the space is an own space of.
+        Space* end = nullptr;    // New end space, or nullptr to keep the end.
+        Space* begin = nullptr;  // New begin space, or nullptr to keep the begin.
+        int end_at = 0;
+        int begin_at = 0;
+    };
+
+    // Finds the piece of sp, or of the spaces added since added_begin,
+    // covering the tile at longitude at on a dir hall's line.
+    Space* piece_at(Space* sp, SpaceId added_begin, Dir dir, int loc, int at) {
+        Rect tile;
+        tile.begin_latitude(dir) = loc;
+        tile.end_latitude(dir) = loc + 1;
+        tile.begin_longitude(dir) = at;
+        tile.end_longitude(dir) = at + 1;
+        if (get_shape(*sp).contains(tile)) {
+            return sp;
+        }
+        for (SpaceId i : number_range(added_begin, SpaceId(rooms.size()))) {
+            if (get_shape(rooms[i]).contains(tile)) {
+                return &rooms[i];
+            }
+        }
+        assert(false);
+        return sp;
+    }
+
+    // Applies a repair, with its spaces already moved into rooms.
+    template <typename Dead>
+    void repair_hall(HallRepair const& rep, Dead&& is_dead, SpaceId added_begin) {
+        Space* hall = &rooms[rep.hall];
+        auto const hd = hall->data.hall;
+
+        // Ends in the old subtree go with it.
+        ArrayVector<SpaceId,8> links;
+        for (auto e = edge_lists[rep.hall].head; e != no_edge; e = edge_nodes[e].next) {
+            links.push_back(edge_nodes[e].to);
+        }
+        for (auto id : links) {
+            if (is_dead(id)) {
+                remove_edge(hall, &rooms[id]);
+            }
+        }
+
+        if (rep.end && rep.begin) {
+            // Cut in two, the second half taking over the end's links.
+            auto tail = add_space(Space{});
+            tail->type = SpaceType::HALL;
+            tail->data.hall = hd;
+            tail->data.hall.begin = rep.begin_at + 1;
+            for (auto id : links) {
+                if (!is_dead(id) && get_shape(rooms[id]).begin_longitude(hd.dir) == hd.end) {
+                    remove_edge(hall, &rooms[id]);
+                    remove_edge(&rooms[id], hall);
+                    link(tail, &rooms[id]);
+                }
+            }
+            proc_collision(tail, piece_at(rep.begin, added_begin, hd.dir, hd.dir_loc, rep.begin_at), hd.dir, hd.dir_loc);
+        } else if (rep.begin) {
+            hall->data.hall.begin = rep.begin_at + 1;
+            proc_collision(hall, piece_at(rep.begin, added_begin, hd.dir, hd.dir_loc, rep.begin_at), hd.dir, hd.dir_loc);
+        }
+
+        if (rep.end) {
+            hall->data.hall.end = rep.end_at;
+            proc_collision(hall, piece_at(rep.end, added_begin, hd.dir, hd.dir_loc, rep.end_at), hd.dir, hd.dir_loc);
+        }
+    }
+
+    static int intpow(int a, int e) {
+        int rv = 1;
+        for (int i=0; i<e; ++i) {
+            rv *= a;
+        }
+        return rv;
+    }
+
+    Space* add_space(Space sp) {
+        dungeon_stat_count(spaces_added);
+        if (rooms.size() == rooms.capacity()) {
+            throw RoomsFull{};
+        }
+        rooms.push_back(move(sp));
+        edge_lists.push_back(EdgeList{});
+        return &rooms.back();
+    }
+
+public:
+
+    BasicDungeon() = default;
+    BasicDungeon(BasicDungeon const&) = delete;
+    BasicDungeon& operator=(BasicDungeon const&) = delete;
+
+    template <typename T>
+    void seed(T s) {
+        rng.seed(s);
+        seed_value = uint64_t(s);
+    }
+
+    // Last seed given to the rng. go() reproduces a dungeon from it only
+    // if it is the first go() after seeding. Counter mode keys every draw
+    // on all 64 bits of it; engines may use fewer, as mt19937 does.
+    uint64_t get_seed() const {
+        return seed_value;
+    }
+
+    // Number of heap allocations made for generation so far,
+    // including those of the parallel job dungeons.
+    size_t allocation_count() const {
+        auto rv = counter.allocations;
+        for (auto& jd : job_dungeons) {
+            rv += jd->allocation_count();
+        }
+        return rv;
+    }
+
+    void set_params(DungeonParams const& params) {
+        config.set(params);
+    }
+
+    DungeonParams get_params() const {
+        return config.get();
+    }
+
+    // In counter mode every draw is a hash of the seed and the split tree
+    // node it is made for, instead of coming from the engine in sequence.
+    // Any subtree then carves the same on its own, in any order and on any
+    // thread, and the dungeon for a seed doesn't depend on the parallel
+    // depth. Dungeons differ from those of the engine. Node ids wrap past
+    // depth 64, so deeper trees may repeat draws.
+    void set_counter_rng(bool enable) {
+        counter_rng = enable;
+    }
+
+    bool get_counter_rng() const {
+        return counter_rng;
+    }
+
+    // Carves subtrees below depth as independent jobs on tw.
+    // The result only depends on the seed and depth, so a null tw
+    // (carving the jobs on this thread) gives the same dungeon.
+    // A depth of 0 disables parallel generation.
+    void set_parallel(Workers* tw, int depth) {
+        workers = tw;
+        parallel_depth = depth;
+    }
+
+    void go(int w, int h) {
+        if (w <= config.room_width_min || h <= config.room_width_min) {
+			throw logic_error("Dungeon::go(): Dungeon is too small to create any rooms!");
+		}
+
+        width = w;
+        height = h;
+
+        stats = DungeonStats{};
+        dungeon_stat_phase(OTHER);
+
+        auto all = carve_with_retry(width, height, 1, max_cache(width, height, 1), [&]{
+            auto data = bind_area(Rect{0, height, 0, width});
+            return (parallel_depth > 0 ? carve_parallel(data) : carve_rooms(data, 1));
+        });
+
+        assert(&*all.spaces.begin() == &*rooms.begin());
+        (void)all;
+
+        pack_edges();
+        table.assign(rooms);
+        refit_tree();
+        build_grid();
+        can_reroll = true;
+    }
+
+    // Generates the same dungeon as go() in counter mode, but a level of
+    // the split tree at a time: every split of a level is decided in one
+    // batch, then every room in another, on the workers given to
+    // set_parallel() if any (at any depth). Halls are then carved in one
+    // pass over the tree, as each one's place depends on the spaces of the
+    // halves it joins.
+    // Requires counter mode, since draws must not depend on their order.
+    void go_levels(int w, int h) {
+        if (!counter_rng) {
+            throw logic_error("Dungeon::go_levels(): Level generation requires counter mode!");
+        }
+        if (w <= config.room_width_min || h <= config.room_width_min) {
+            throw logic_error("Dungeon::go_levels(): Dungeon is too small to create any rooms!");
+        }
+
+        width = w;
+        height = h;
+
+        stats = DungeonStats{};
+        dungeon_stat_phase(OTHER);
+
+        plan_levels(Rect{0, height, 0, width});
+
+        auto all = carve_with_retry(width, height, 1, max_cache(width, height, 1), [&]{
+            return carve_levels(bind_area(Rect{0, height, 0, width}));
+        });
+
+        assert(&*all.spaces.begin() == &*rooms.begin());
+        (void)all;
+
+        pack_edges();
+        table.assign(rooms);
+        refit_tree();
+        build_grid();
+        can_reroll = true;
+    }
+
+    // Generates only the part of a w by h dungeon that query needs, for maps
+    // too big to carve whole. The split tree is expanded down to nodes
+    // intersecting query, and every space of such a node comes out the same
+    // for any query containing it, so a world can be carved a region at a
+    // time. Spaces reaching outside query are kept whole.
+    // Requires counter mode. Nodes of more than the region chunk size a
+    // side are joined by corridors instead of halls, so the layout differs
+    // from go()'s.
+    void go_region(int w, int h, Rect const& query) {
+        if (!counter_rng) {
+            throw logic_error("Dungeon::go_region(): Region generation requires counter mode!");
+        }
+        if (w <= config.room_width_min || h <= config.room_width_min) {
+            throw logic_error("Dungeon::go_region(): Dungeon is too small to create any rooms!");
+        }
+
+        width = w;
+        height = h;
+
+        stats = DungeonStats{};
+        dungeon_stat_phase(OTHER);
+
+        can_reroll = false;
+        region_nodes.clear();
+        jobs.clear();
+        plan_region(Rect{0, height, 0, width}, 1, 1, -1, query);
+
+        job_results.reserve(jobs.size());
+        job_futures.reserve(jobs.size());
+        while (job_dungeons.size() < jobs.size()) {
+            job_dungeons.push_back(make_unique<BasicDungeon>());
+            counter.count(sizeof(BasicDungeon));
+        }
+
+        run_jobs([](BasicDungeon& jd, SubtreeJob const& job){
+            return jd.carve_chunk(job);
+        });
+        merge_job_stats();
+
+        // A chunk side's link adds a hall and a junction at most.
+        size_t total = 0;
+        size_t nodes = 0;
+        for (auto const& rn : region_nodes) {
+            if (rn.dir != Dir::NONE) {
+                total += 1;
+            } else if (rn.chunk >= 0) {
+                total += job_dungeons[rn.chunk]->rooms.size() + 4*3;
+            }
+            nodes += (rn.chunk >= 0 ? job_dungeons[rn.chunk]->tree.size() : 1);
+        }
+
+        rooms.clear();
+        rooms.reserve(total);
+        auto cap = rooms.capacity();
+
+        clear_edges();
+        edge_lists.reserve(cap);
+        edge_nodes.reserve(cap * max_edges_per_space);
+        table.reserve(cap);
+
+        tree.clear();
+        tree.reserve(nodes);
+
+        // Parents come before their children, so corridors exist before
+        // anything links to them, and the tree comes out in preorder.
+        for (int i : number_range(0,int(region_nodes.size()))) {
+            auto& rn = region_nodes[i];
+            rn.tree = uint32_t(tree.size());
+            if (rn.dir != Dir::NONE) {
+                add_corridor(i);
+                push_tree_node(rn.dir, rn.pos);
+                tree.back().space_begin = SpaceId(rn.corridor);
+                tree.back().space_end = SpaceId(rn.corridor + 1);
+            } else if (rn.chunk >= 0) {
+                add_chunk(i);
+            } else {
+                push_tree_node(Dir::NONE, 0);
+                tree.back().space_begin = SpaceId(rooms.size());
+                tree.back().space_end = SpaceId(rooms.size());
+            }
+        }
+
+        for (auto i = region_nodes.size(); i-- > 0;) {
+            auto const& rn = region_nodes[i];
+            if (rn.dir != Dir::NONE) {
+                auto& n = tree[rn.tree];
+                for (int c : {0, 1}) {
+                    n.children[c] = region_nodes[rn.children[c]].tree;
+                    n.space_end = max(n.space_end, tree[n.children[c]].space_end);
+                }
+            }
+        }
+
+        pack_edges();
+        table.assign(rooms);
+        refit_tree();
+        build_grid();
+    }
+
+    // Largest side of a node go_region() carves as one chunk.
+    void set_region_chunk(int side) {
+        region_chunk = side;
+    }
+
+    int get_region_chunk() const {
+        return region_chunk;
+    }
+
+    // Split tree of the last go_region(), root first. Nodes outside the
+    // query are left unexpanded, with only their rect and place in the tree.
+    ArrayView<RegionNode const> get_region_nodes() const {
+        return ArrayView<RegionNode const>(region_nodes.data(), region_nodes.data() + region_nodes.size());
+    }
+
+    // Carves the subtree at node idx of get_tree() again from new_seed,
+    // keeping the rest of the dungeon. Only the subtree and the ancestors'
+    // halls reaching into it are carved, though spaces and tree nodes after
+    // it are renumbered. The subtree comes out as carve_rooms() makes it
+    // from new_seed, so rerolling the root is go() with that seed.
+    // Returns false, changing nothing, if a hall reaching into the subtree
+    // has nothing to end on in the new one, or would cross something;
+    // another seed may do.
+    // Only go()'s tree can be rerolled, and not after a transform.
+    bool reroll(uint32_t idx, uint64_t new_seed) {
+        if (!can_reroll) {
+            throw logic_error("Dungeon::reroll(): Only an untransformed go() can be rerolled!");
+        }
+        if (idx >= tree.size()) {
+            throw logic_error("Dungeon::reroll(): No such tree node!");
+        }
+
+        // Walk down to the node for its rect, id and depth.
+        vector<uint32_t> path;
+        Rect rect {0, height, 0, width};
+        uint64_t node = 1;
+        int depth = 1;
+        for (uint32_t i = 0; i != idx; ++depth) {
+            auto const& n = tree[i];
+            int const which = (idx >= n.children[1] ? 1 : 0);
+            auto halves = rect.split(n.dir, n.pos);
+            path.push_back(i);
+            rect = (which ? halves.second : halves.first);
+            node = node*2 + which;
+            i = n.children[which];
+        }
+
+        if (job_dungeons.empty()) {
+            job_dungeons.push_back(make_unique<BasicDungeon>());
+            counter.count(sizeof(BasicDungeon));
+        }
+        BasicDungeon& jd = *job_dungeons[0];
+        jd.set_params(get_params());
+        jd.counter_rng = counter_rng;
+        jd.seed_value = new_seed;
+        jd.carve_chunk(SubtreeJob{rect, depth, node, typename Engine::result_type(new_seed)});
+
+        auto const old_begin = tree[idx].space_begin;
+        auto const old_end = tree[idx].space_end;
+
+        // Ancestors' spaces are all that can reach into the node.
+        vector<HallRepair> repairs;
+        vector<SpaceId> dead;
+        for (auto a : path) {
+            for_own_spaces(tree[a], [&](Space const& sp){
+                repairs.push_back(HallRepair{id_of(&sp), a});
+            });
+        }
+        auto is_dead = [&](SpaceId id){
+            return (id >= old_begin && id < old_end) || find(dead.begin(), dead.end(), id) != dead.end();
+        };
+        auto is_repaired = [&](SpaceId id){
+            return any_of(repairs.begin(), repairs.end(), [&](HallRepair const& rep){ return rep.hall == id; });
+        };
+        auto on_line = [](Space const& sp, Dir dir, int loc){
+            auto shape = get_shape(sp);
+            return shape.begin_latitude(dir) <= loc && loc < shape.end_latitude(dir);
+        };
+
+        // Junctions the ancestors cut into the old subtree's halls go with
+        // it. They're found by following each hall along its line.
+        struct LinePiece {
+            SpaceId id;
+            Dir dir;
+            int loc;
+        };
+        vector<LinePiece> line;
+        for (SpaceId id : number_range(old_begin, old_end)) {
+            if (rooms[id].type == SpaceType::HALL) {
+                line.push_back(LinePiece{id, rooms[id].data.hall.dir, rooms[id].data.hall.dir_loc});
+            }
+        }
+        while (!line.empty()) {
+            auto const p = line.back();
+            line.pop_back();
+            for (auto e = edge_lists[p.id].head; e != no_edge; e = edge_nodes[e].next) {
+                auto const to = edge_nodes[e].to;
+                Space const& n = rooms[to];
+                auto const shape = get_shape(n);
+                if (is_dead(to) || !rect.contains(shape)) {
+                    continue;
+                }
+                bool const piece = (n.type == SpaceType::HALL
+                    ? n.data.hall.dir == p.dir && n.data.hall.dir_loc == p.loc
+                    : shape.begin_latitude(p.dir) == p.loc && shape.len_latitude(p.dir) == 1 && shape.len_longitude(p.dir) == 1);
+                if (piece) {
+                    dead.push_back(to);
+                    line.push_back(LinePiece{to, p.dir, p.loc});
+                }
+            }
+        }
+        repairs.erase(remove_if(repairs.begin(), repairs.end(), [&](HallRepair const& rep){
+            return is_dead(rep.hall);
+        }), repairs.end());
+
+        // Work out every repair before changing anything. Whatever linked to
+        // the spaces that go must be one of the ancestors' halls.
+        auto orphans = [&](SpaceId id){
+            for (auto e = edge_lists[id].head; e != no_edge; e = edge_nodes[e].next) {
+                auto const to = edge_nodes[e].to;
+                if (!is_dead(to) && (rooms[to].type != SpaceType::HALL || !is_repaired(to))) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        for (SpaceId id : number_range(old_begin, old_end)) {
+            if (orphans(id)) {
+                return false;
+            }
+        }
+        for (auto id : dead) {
+            if (orphans(id)) {
+                return false;
+            }
+        }
+
+        // A hall whose end went ends at the nearest new space on its line
+        // instead, and one with new spaces in its way is cut around them.
+        vector<Rect> shapes;
+        for (auto& rep : repairs) {
+            Space const& sp = rooms[rep.hall];
+            Rect shape = get_shape(sp);
+            if (sp.type != SpaceType::HALL) {
+                shapes.push_back(shape);
+                continue;
+            }
+
+            auto const& hd = sp.data.hall;
+            bool dead_begin = false;
+            bool dead_end = false;
+            for (auto e = edge_lists[rep.hall].head; e != no_edge; e = edge_nodes[e].next) {
+                auto const to = edge_nodes[e].to;
+                if (is_dead(to)) {
+                    bool const at_end = (get_shape(rooms[to]).begin_longitude(hd.dir) == hd.end);
+                    (at_end ? dead_end : dead_begin) = true;
+                }
+            }
+
+            Space* after = nullptr;
+            Space* before = nullptr;
+            for (Space& n : jd.rooms) {
+                if (!on_line(n, hd.dir, hd.dir_loc)) {
+                    continue;
+                }
+                auto const ns = get_shape(n);
+                if (ns.begin_longitude(hd.dir) >= hd.begin &&
+                    (!after || ns.begin_longitude(hd.dir) < get_shape(*after).begin_longitude(hd.dir))) {
+                    after = &n;
+                }
+                if (ns.end_longitude(hd.dir) <= hd.end &&
+                    (!before || ns.end_longitude(hd.dir) > get_shape(*before).end_longitude(hd.dir))) {
+                    before = &n;
+                }
+            }
+
+            if (dead_begin && dead_end) {
+                return false;
+            } else if (dead_end) {
+                rep.end = after;
+            } else if (dead_begin) {
+                rep.begin = before;
+            } else if (after && get_shape(*after).begin_longitude(hd.dir) < hd.end) {
+                if (!before) {
+                    return false;
+                }
+                rep.end = after;
+                rep.begin = before;
+            }
+            if ((dead_end && !rep.end) || (dead_begin && !rep.begin)) {
+                return false;
+            }
+
+            if (rep.end) {
+                rep.end_at = get_shape(*rep.end).begin_longitude(hd.dir);
+            }
+            if (rep.begin) {
+                rep.begin_at = get_shape(*rep.begin).end_longitude(hd.dir) - 1;
+            }
+            if (rep.end && rep.begin) {
+                Rect tail = shape;
+                tail.begin_longitude(hd.dir) = rep.begin_at + 1;
+                shapes.push_back(tail);
+            }
+            if (rep.end) {
+                shape.end_longitude(hd.dir) = rep.end_at;
+            } else if (rep.begin) {
+                shape.begin_longitude(hd.dir) = rep.begin_at + 1;
+            }
+            shapes.push_back(shape);
+        }
+
+        // Nothing that stays may overlap the new subtree or each other.
+        for (size_t i : number_range(size_t(0),shapes.size())) {
+            if (!shapes[i].intersects(rect)) {
+                continue;
+            }
+            for (size_t j : number_range(size_t(0),shapes.size())) {
+                if (j != i && shapes[i].intersects(shapes[j])) {
+                    return false;
+                }
+            }
+            for (Space const& n : jd.rooms) {
+                if (shapes[i].intersects(get_shape(n))) {
+                    return false;
+                }
+            }
+        }
+
+        // Splice the new subtree in after everything and repair the halls.
+        // A repair adds a hall and two junctions at most.
+        rooms.reserve(rooms.size() + jd.rooms.size() + repairs.size()*5);
+        Space* job_base = jd.rooms.data();
+        auto const new_base = id_of(splice_spaces(0));
+        auto const added_begin = SpaceId(rooms.size());
+        vector<pair<uint32_t,SpaceId>> added;
+        for (auto rep : repairs) {
+            if (!rep.end && !rep.begin) {
+                continue;
+            }
+            rep.end = (rep.end ? &rooms[new_base] + (rep.end - job_base) : nullptr);
+            rep.begin = (rep.begin ? &rooms[new_base] + (rep.begin - job_base) : nullptr);
+            auto const before = SpaceId(rooms.size());
+            repair_hall(rep, is_dead, added_begin);
+            for (SpaceId i : number_range(before, SpaceId(rooms.size()))) {
+                added.emplace_back(rep.owner, i);
+            }
+        }
+
+        // Move the new subtree into the old one's place. Spaces before it
+        // keep their ids. Those after it shift, less the junctions that went
+        // and plus the repairs, which go at the end of their owner's range,
+        // where go() puts a split's own spaces. bounds maps the old range
+        // boundaries after the subtree to the new ones.
+        vector<SpaceId> order;
+        order.reserve(rooms.size() - old_begin);
+        for (SpaceId i : number_range(new_base, added_begin)) {
+            order.push_back(i);
+        }
+        vector<SpaceId> bounds (new_base - old_end + 1);
+        SpaceId pos = old_end;
+        auto emit_to = [&](SpaceId end){
+            for (; pos < end; ++pos) {
+                bounds[pos - old_end] = old_begin + SpaceId(order.size());
+                if (!is_dead(pos)) {
+                    order.push_back(pos);
+                }
+            }
+        };
+        for (auto a = path.rbegin(); a != path.rend(); ++a) {
+            emit_to(tree[*a].space_end);
+            for (auto const& add : added) {
+                if (add.first == *a) {
+                    order.push_back(add.second);
                 }
             }
         }
+        emit_to(new_base);
+        bounds.back() = old_begin + SpaceId(order.size());
+
+        vector<SpaceId> remap (rooms.size() - old_begin, SpaceId(-1));
+        for (SpaceId i : number_range(SpaceId(0),SpaceId(order.size()))) {
+            remap[order[i] - old_begin] = old_begin + i;
+        }
+        auto new_id = [&](SpaceId id){
+            return (id < old_begin ? id : remap[id - old_begin]);
+        };
+        auto new_bound = [&](SpaceId b){
+            return (b < old_end ? b : bounds[b - old_end]);
+        };
+
+        vector<Space> moved (rooms.begin() + old_begin, rooms.end());
+        vector<EdgeList> moved_lists (edge_lists.begin() + old_begin, edge_lists.end());
+        rooms.resize(old_begin);
+        edge_lists.resize(old_begin);
+        for (SpaceId id : order) {
+            rooms.push_back(moved[id - old_begin]);
+            edge_lists.push_back(moved_lists[id - old_begin]);
+        }
+
+        // Edges of dropped spaces are left unreachable in edge_nodes.
+        for (auto const& list : edge_lists) {
+            for (auto e = list.head; e != no_edge; e = edge_nodes[e].next) {
+                edge_nodes[e].to = new_id(edge_nodes[e].to);
+            }
+        }
+        for (SpaceId i : number_range(SpaceId(0),edge_offsets[old_begin])) {
+            edge_targets[i] = new_id(edge_targets[i]);
+        }
+
+        // The old subtree's nodes are a contiguous run in preorder.
+        auto old_last = idx;
+        while (tree[old_last].dir != Dir::NONE) {
+            old_last = tree[old_last].children[1];
+        }
+        auto const old_nodes_end = old_last + 1;
+        auto const node_shift = uint32_t(jd.tree.size()) - (old_nodes_end - idx);
+        for (auto& n : tree) {
+            if (n.dir != Dir::NONE) {
+                for (auto& c : n.children) {
+                    c += (c >= old_nodes_end ? node_shift : 0);
+                }
+            }
+            n.space_begin = new_bound(n.space_begin);
+            n.space_end = new_bound(n.space_end);
+        }
+        tree.erase(tree.begin() + idx, tree.begin() + old_nodes_end);
+        tree.insert(tree.begin() + idx, jd.tree.begin(), jd.tree.end());
+        for (auto i : number_range(idx, idx + uint32_t(jd.tree.size()))) {
+            auto& n = tree[i];
+            if (n.dir != Dir::NONE) {
+                n.children[0] += idx;
+                n.children[1] += idx;
+            }
+            n.space_begin += old_begin;
+            n.space_end += old_begin;
+        }
+
+        // Only the new nodes and the ancestors have new bounds.
+        for (auto i = idx + uint32_t(jd.tree.size()); i-- > idx;) {
+            refit_node(i);
+        }
+        for (auto a = path.rbegin(); a != path.rend(); ++a) {
+            refit_node(*a);
+        }
+
+        pack_edges(old_begin);
+        table.assign(rooms, old_begin);
+        build_grid();
+        return true;
+    }
+
+    // Builds a uniform grid over the spaces after every go(), go_region()
+    // and transform(), for range queries that don't walk the split tree.
+    // It is written to dungeon files along with the spaces.
+    void set_spatial_index(bool enable) {
+        use_grid = enable;
+    }
+
+    bool get_spatial_index() const {
+        return use_grid;
+    }
+
+    // The spatial index, empty unless it's on. Its queries take get_table().
+    SpaceGridView get_grid() const {
+        return grid.view();
+    }
+
+    // Split tree of the last go() or go_region(), root first.
+    ArrayView<SplitNode const> get_tree() const {
+        return ArrayView<SplitNode const>(tree.data(), tree.data() + tree.size());
+    }
+
+    // Space covering the tile at (r,c), or nullptr for walls.
+    // Looks in the spatial index if it's on, otherwise walks down the split
+    // tree, taking time in the tree's depth.
+    Space const* locate(int r, int c) const {
+        if (use_grid) {
+            auto id = grid.view().locate(table, r, c);
+            return (id == SpaceGridView::no_space ? nullptr : &rooms[id]);
+        }
+        Space const* rv = nullptr;
+        auto sink = [&](Space const& sp){
+            rv = &sp;
+            return true;
+        };
+        if (!tree.empty()) {
+            visit_tree(0, Rect{r, r+1, c, c+1}, sink);
+        }
+        return rv;
+    }
+
+    // Calls sink(space) for every space intersecting rect, using the
+    // spatial index if it's on.
+    template <typename Sink>
+    void query(Rect const& rect, Sink&& sink) const {
+        if (use_grid) {
+            grid.view().query(table, rect, [&](SpaceId id){
+                sink(rooms[id]);
+            });
+            return;
+        }
+        auto each = [&](Space const& sp){
+            sink(sp);
+            return false;
+        };
+        if (!tree.empty()) {
+            visit_tree(0, rect, each);
+        }
+    }
+
+    template <typename Out>
+    void print_dot(Out& out) {
+        out << "graph g {" << endl;
+        for (SpaceId id : number_range(SpaceId(0),SpaceId(rooms.size()))) {
+            Space const& s = rooms[id];
+            auto rect = get_shape(s);
+            out << "    " << id << " ["
+                << "label=\""
+                    << (s.type==SpaceType::ROOM? "Room " : "Hall ")
+                    << rect.begin_r << "-" << rect.end_r << ":"
+                    << rect.begin_c << "-" << rect.end_c << "\" "
+                << "pos=\""
+                    << ((rect.begin_c+rect.end_c)*72/2) << ","
+                    << ((rect.begin_r+rect.end_r)*72/2) << "\" "
+                << "];" << endl;
+            for (SpaceId id2 : neighbors(id)) {
+                if (id < id2) {
+                    out << "    " << id << " -- " << id2 << ";" << endl;
+                }
+            }
+        }
+        out << "}" << endl;
+    }
+
+    // Applies a transform built for this dungeon's current size.
+    void transform(Transform const& xf) {
+        if (xf.source_width() != width || xf.source_height() != height) {
+            throw logic_error("Dungeon::transform(): Transform was built for a different map size!");
+        }
+        can_reroll = false;
+        xf.apply(table);
+        table.store(rooms);
+        for (auto& n : tree) {
+            if (n.dir != Dir::NONE && xf.map_split(n.dir, n.pos)) {
+                swap(n.children[0], n.children[1]);
+            }
+        }
+        refit_tree();
+        width = xf.width();
+        height = xf.height();
+        build_grid();
+    }
+
+    void sub(int x) {
+        transform(Transform(width, height).sub(x));
+    }
+
+    void mult(int x) {
+        transform(Transform(width, height).mult(x));
+    }
+
+    int num_cols() const {
+        return width;
+    }
+
+    int num_rows() const {
+        return height;
+    }
+
+    SpaceVec const& get_spaces() const {
+        return rooms;
+    }
+
+    // Counters and phase times of the last go().
+    // All zero when built with DUNGEON_STATS_OFF.
+    DungeonStats const& get_stats() const {
+        return stats;
+    }
+
+    // Struct-of-arrays view of get_spaces().
+    SpaceTable const& get_table() const {
+        return table;
+    }
+
+    SpaceId space_id(Space const& sp) const {
+        return id_of(&sp);
+    }
+
+    ArrayView<SpaceId const> neighbors(SpaceId id) const {
+        assert(id < rooms.size());
+        auto base = edge_targets.data();
+        return ArrayView<SpaceId const>(base + edge_offsets[id], base + edge_offsets[id+1]);
+    }
+
+    // Writes one byte per tile into out, row r at out + r*stride.
+    void rasterize(unsigned char* out, size_t stride, TilePalette const& palette = raw_palette) const {
+        ::rasterize(table, width, height, out, stride, palette);
+    }
+
+    void rasterize(PackedTiles& out) const {
+        ::rasterize(table, width, height, out);
+    }
+
+    // Streams the map a band of rows at a time, see BandRasterizer::run().
+    template <typename Sink>
+    void stream_tiles(BandRasterizer& rast, int band_rows, Sink&& sink, TilePalette const& palette = raw_palette) const {
+        rast.run(table, width, height, band_rows, sink, palette);
+    }
+
+    vector<string> print_tiles() const {
+        string grid (size_t(width) * height, '#');
+        rasterize(reinterpret_cast<unsigned char*>(&grid[0]), width, text_palette);
+        vector<string> tiles;
+        tiles.reserve(height);
+        for (int r=0; r<height; ++r) {
+            tiles.emplace_back(grid, size_t(r) * width, width);
+        }
         return tiles;
     }
 };
+
+using Dungeon = BasicDungeon<mt19937>;
+
+#endif // DUNGEON_HPP
@@ -0,0 +1,150 @@
+#ifndef DUNGEON_CACHE_HPP
+#define DUNGEON_CACHE_HPP
+
+#include "dungeon.hpp"
+#include "dungeon_file.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+// Everything go() output depends on.
+struct DungeonKey {
+    std::uint64_t seed;
+    int width;
+    int height;
+    DungeonParams params;
+
+    bool operator==(DungeonKey const& other) const {
+        return seed == other.seed
+            && width == other.width
+            && height == other.height
+            && params == other.params;
+    }
+};
+
+struct DungeonKeyHash {
+    std::size_t operator()(DungeonKey const& key) const {
+        std::size_t rv = std::hash<std::uint64_t>{}(key.seed);
+        auto mix = [&](std::size_t v){
+            rv ^= v + 0x9e3779b97f4a7c15ull + (rv << 6) + (rv >> 2);
+        };
+        mix(std::hash<int>{}(key.width));
+        mix(std::hash<int>{}(key.height));
+        mix(std::hash<int>{}(key.params.room_width_min));
+        mix(std::hash<int>{}(key.params.room_height_min));
+        mix(std::hash<double>{}(key.params.room_ratio_min));
+        mix(std::hash<int>{}(key.params.depth_max));
+        return rv;
+    }
+};
+
+// Thread-safe cache of generated dungeons, evicting the least recently used
+// once the entries' bytes go over a budget.
+// Since seed() followed by go() always gives the same dungeon, a key fully
+// determines its entry. Entries are immutable DungeonBlobs shared with every
+// caller, and stay valid for as long as a caller holds them, evicted or not.
+// Concurrent misses on the same key may each generate it; the first one
+// stored wins.
+class DungeonCache {
+public:
+    using Entry = std::shared_ptr<DungeonBlob const>;
+
+    struct Stats {
+        std::size_t hits = 0;
+        std::size_t misses = 0;
+        std::size_t evictions = 0;
+        std::size_t entries = 0;
+        std::size_t bytes = 0;
+    };
+
+private:
+    using Lru = std::list<std::pair<DungeonKey, Entry>>;
+
+    mutable std::mutex mt;
+    Lru lru;  // Most recent first.
+    std::unordered_map<DungeonKey, Lru::iterator, DungeonKeyHash> index;
+    std::size_t budget;
+    Stats counts;
+
+    void evict_over_budget() {
+        while (counts.bytes > budget && !lru.empty()) {
+            auto& back = lru.back();
+            counts.bytes -= back.second->footprint();
+            index.erase(back.first);
+            lru.pop_back();
+            ++counts.evictions;
+        }
+    }
+
+public:
+
+    explicit DungeonCache(std::size_t byte_budget) : budget(byte_budget) {}
+
+    DungeonCache(DungeonCache const&) = delete;
+    DungeonCache& operator=(DungeonCache const&) = delete;
+
+    // Returns the cached dungeon for the key, generating it on a miss.
+    Entry get(std::uint64_t seed, int width, int height, DungeonParams const& params = {}) {
+        DungeonKey key {seed, width, height, params};
+
+        {
+            std::unique_lock<std::mutex> lk (mt);
+            auto iter = index.find(key);
+            if (iter != index.end()) {
+                lru.splice(lru.begin(), lru, iter->second);
+                ++counts.hits;
+                return iter->second->second;
+            }
+            ++counts.misses;
+        }
+
+        thread_local Dungeon dung;
+        dung.set_params(params);
+        dung.seed(seed);
+        dung.go(width, height);
+        auto entry = std::make_shared<DungeonBlob const>(dung);
+
+        std::unique_lock<std::mutex> lk (mt);
+        auto iter = index.find(key);
+        if (iter != index.end()) {
+            lru.splice(lru.begin(), lru, iter->second);
+            return iter->second->second;
+        }
+        if (entry->footprint() <= budget) {
+            lru.emplace_front(key, entry);
+            index.emplace(key, lru.begin());
+            counts.bytes += entry->footprint();
+            evict_over_budget();
+        }
+        return entry;
+    }
+
+    // Changes the budget, evicting right away if needed.
+    void set_budget(std::size_t byte_budget) {
+        std::unique_lock<std::mutex> lk (mt);
+        budget = byte_budget;
+        evict_over_budget();
+    }
+
+    void clear() {
+        std::unique_lock<std::mutex> lk (mt);
+        lru.clear();
+        index.clear();
+        counts.bytes = 0;
+    }
+
+    Stats stats() const {
+        std::unique_lock<std::mutex> lk (mt);
+        auto rv = counts;
+        rv.entries = lru.size();
+        return rv;
+    }
+};
+
+#endif // DUNGEON_CACHE_HPP
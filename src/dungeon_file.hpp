@@ -0,0 +1,496 @@
+#ifndef DUNGEON_FILE_HPP
+#define DUNGEON_FILE_HPP
+
+#include "dungeon.hpp"
+#include "array_view.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef __MINGW32__
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// Binary dungeon file.
+//
+// A DungeonFileHeader followed by the space table columns, the packed
+// neighbor lists and the spatial index, each section starting on a
+// section_align boundary:
+//
+//   begin_r, end_r, begin_c, end_c  int32_t[num_spaces]
+//   dir                             int32_t[num_spaces] (Dir values)
+//   edge_offsets                    uint32_t[num_spaces + 1]
+//   edge_targets                    uint32_t[num_edges]
+//   grid_offsets                    uint32_t[grid_rows * grid_cols + 1]
+//   grid_items                      uint32_t[num_grid_items]
+//
+// The grid sections are empty if the dungeon had no spatial index.
+// Everything is in the writer's byte order, which the endian field records.
+// Since a mapped file starts on a page boundary, every section can be used
+// in place, which is what DungeonView does.
+struct DungeonFileHeader {
+    static constexpr std::uint32_t magic_value = 0x50534244;  // "DBSP"
+    static constexpr std::uint32_t version_value = 3;
+    static constexpr std::uint32_t endian_value = 0x01020304;
+    static constexpr std::size_t section_align = 64;
+
+    enum Section {
+        BEGIN_R,
+        END_R,
+        BEGIN_C,
+        END_C,
+        DIR,
+        EDGE_OFFSETS,
+        EDGE_TARGETS,
+        GRID_OFFSETS,
+        GRID_ITEMS,
+        NUM_SECTIONS,
+    };
+
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t endian;
+    std::uint32_t reserved;  // Keeps seed 8-byte aligned.
+    std::uint64_t seed;
+
+    std::int32_t width;
+    std::int32_t height;
+    std::int32_t room_width_min;
+    std::int32_t room_height_min;
+    double room_ratio_min;
+    std::int32_t depth_max;
+
+    std::uint32_t num_spaces;
+    std::uint32_t num_edges;
+
+    std::int32_t grid_shift;
+    std::int32_t grid_rows;
+    std::int32_t grid_cols;
+    std::uint32_t num_grid_items;
+
+    std::uint64_t section_offset[NUM_SECTIONS];
+    std::uint64_t file_size;
+
+    // Size of section s, not counting padding.
+    std::uint64_t section_bytes(int s) const {
+        switch (s) {
+            case EDGE_OFFSETS: return (std::uint64_t(num_spaces) + 1) * 4;
+            case EDGE_TARGETS: return std::uint64_t(num_edges) * 4;
+            case GRID_OFFSETS: return (grid_rows > 0 ? (std::uint64_t(grid_rows) * grid_cols + 1) * 4 : 0);
+            case GRID_ITEMS: return std::uint64_t(num_grid_items) * 4;
+            default: return std::uint64_t(num_spaces) * 4;
+        }
+    }
+};
+
+static_assert(sizeof(Dir) == sizeof(std::int32_t), "Dir must be stored as int32_t");
+static_assert(sizeof(SpaceId) == sizeof(std::uint32_t), "SpaceId must be stored as uint32_t");
+
+// Header of dung's file, with the section layout filled in.
+template <typename Engine, typename Config>
+DungeonFileHeader dungeon_file_header(BasicDungeon<Engine,Config> const& dung) {
+    using H = DungeonFileHeader;
+
+    auto const n = std::uint32_t(dung.get_table().size());
+    std::uint32_t num_edges = 0;
+    for (SpaceId id=0; id<n; ++id) {
+        num_edges += std::uint32_t(dung.neighbors(id).size());
+    }
+
+    auto params = dung.get_params();
+
+    H header {};
+    header.magic = H::magic_value;
+    header.version = H::version_value;
+    header.endian = H::endian_value;
+    header.seed = dung.get_seed();
+    header.width = dung.num_cols();
+    header.height = dung.num_rows();
+    header.room_width_min = params.room_width_min;
+    header.room_height_min = params.room_height_min;
+    header.room_ratio_min = params.room_ratio_min;
+    header.depth_max = params.depth_max;
+    header.num_spaces = n;
+    header.num_edges = num_edges;
+
+    auto const grid = dung.get_grid();
+    if (!grid.empty()) {
+        header.grid_shift = grid.shift;
+        header.grid_rows = grid.rows;
+        header.grid_cols = grid.cols;
+        header.num_grid_items = std::uint32_t(grid.items.size());
+    }
+
+    std::uint64_t pos = sizeof(H);
+    for (int s=0; s<H::NUM_SECTIONS; ++s) {
+        pos = (pos + H::section_align - 1) / H::section_align * H::section_align;
+        header.section_offset[s] = pos;
+        pos += header.section_bytes(s);
+    }
+    header.file_size = pos;
+
+    return header;
+}
+
+// Emits dung's file through write(bytes, size), in order.
+template <typename Engine, typename Config, typename Write>
+void write_dungeon_bytes(BasicDungeon<Engine,Config> const& dung, Write&& write) {
+    using H = DungeonFileHeader;
+
+    auto const header = dungeon_file_header(dung);
+    auto const& table = dung.get_table();
+    auto const n = header.num_spaces;
+
+    // Neighbor lists are contiguous, in id order.
+    SpaceId const* targets = (n > 0 ? dung.neighbors(0).begin() : nullptr);
+    std::vector<std::uint32_t> offsets (n + 1);
+    for (SpaceId id=0; id<n; ++id) {
+        offsets[id+1] = offsets[id] + std::uint32_t(dung.neighbors(id).size());
+    }
+
+    auto const grid = dung.get_grid();
+
+    void const* const data[H::NUM_SECTIONS] = {
+        table.begin_r.data(), table.end_r.data(), table.begin_c.data(), table.end_c.data(),
+        table.dir.data(), offsets.data(), targets,
+        grid.cell_offsets.begin(), grid.items.begin(),
+    };
+
+    char const zeros[H::section_align] = {};
+    write(&header, sizeof(header));
+    std::uint64_t pos = sizeof(header);
+    for (int s=0; s<H::NUM_SECTIONS; ++s) {
+        if (header.section_offset[s] > pos) {
+            write(zeros, header.section_offset[s] - pos);
+        }
+        auto const bytes = header.section_bytes(s);
+        if (bytes > 0) {
+            write(data[s], bytes);
+        }
+        pos = header.section_offset[s] + bytes;
+    }
+}
+
+// Writes dung's file to out.
+template <typename Engine, typename Config>
+void write_dungeon(BasicDungeon<Engine,Config> const& dung, std::ostream& out) {
+    write_dungeon_bytes(dung, [&](void const* bytes, std::size_t size){
+        out.write(static_cast<char const*>(bytes), size);
+    });
+    if (!out) {
+        throw std::runtime_error("write_dungeon(): Write failed!");
+    }
+}
+
+// Read-only dungeon over the bytes of a dungeon file, used in place.
+// The columns have the same names as SpaceTable's, so the rasterizers in
+// raster.hpp accept a DungeonView too. The bytes must outlive the view and
+// be aligned to DungeonFileHeader::section_align.
+class DungeonView {
+    using H = DungeonFileHeader;
+
+    H const* header = nullptr;
+    ArrayView<std::uint32_t const> edge_offsets;
+    ArrayView<SpaceId const> edge_targets;
+    SpaceGridView grid_view;
+
+    template <typename T>
+    ArrayView<T const> section(unsigned char const* base, std::size_t size, int s, std::size_t n) const {
+        auto off = header->section_offset[s];
+        if (off % alignof(T) != 0 || off > size || n > (size - off) / sizeof(T)) {
+            throw std::runtime_error("DungeonView: Section out of bounds!");
+        }
+        auto p = reinterpret_cast<T const*>(base + off);
+        return ArrayView<T const>(p, p + n);
+    }
+
+public:
+
+    ArrayView<int const> begin_r;
+    ArrayView<int const> end_r;
+    ArrayView<int const> begin_c;
+    ArrayView<int const> end_c;
+    ArrayView<Dir const> dir;
+
+    DungeonView() = default;
+
+    DungeonView(void const* data, std::size_t size) {
+        auto base = static_cast<unsigned char const*>(data);
+        if (reinterpret_cast<std::uintptr_t>(base) % H::section_align != 0) {
+            throw std::runtime_error("DungeonView: Data is not aligned!");
+        }
+        if (size < sizeof(H)) {
+            throw std::runtime_error("DungeonView: Too small for a header!");
+        }
+        header = reinterpret_cast<H const*>(base);
+        if (header->magic != H::magic_value) {
+            throw std::runtime_error("DungeonView: Not a dungeon file!");
+        }
+        if (header->endian != H::endian_value) {
+            throw std::runtime_error("DungeonView: Wrong byte order!");
+        }
+        if (header->version != H::version_value) {
+            throw std::runtime_error("DungeonView: Unsupported version!");
+        }
+        if (header->file_size > size) {
+            throw std::runtime_error("DungeonView: Truncated file!");
+        }
+
+        std::size_t const n = header->num_spaces;
+        begin_r = section<int>(base, size, H::BEGIN_R, n);
+        end_r = section<int>(base, size, H::END_R, n);
+        begin_c = section<int>(base, size, H::BEGIN_C, n);
+        end_c = section<int>(base, size, H::END_C, n);
+        dir = section<Dir>(base, size, H::DIR, n);
+        edge_offsets = section<std::uint32_t>(base, size, H::EDGE_OFFSETS, n + 1);
+        edge_targets = section<SpaceId>(base, size, H::EDGE_TARGETS, header->num_edges);
+
+        if (edge_offsets[0] != 0 || edge_offsets[n] != header->num_edges) {
+            throw std::runtime_error("DungeonView: Bad edge offsets!");
+        }
+        for (std::size_t i=0; i<n; ++i) {
+            if (edge_offsets[i] > edge_offsets[i+1]) {
+                throw std::runtime_error("DungeonView: Bad edge offsets!");
+            }
+        }
+        for (SpaceId id : edge_targets) {
+            if (id >= n) {
+                throw std::runtime_error("DungeonView: Bad edge target!");
+            }
+        }
+
+        if (header->grid_rows > 0) {
+            if (header->grid_cols <= 0 || header->grid_shift < 0 || header->grid_shift > 30) {
+                throw std::runtime_error("DungeonView: Bad grid size!");
+            }
+            auto const cells = std::size_t(header->grid_rows) * std::size_t(header->grid_cols);
+            grid_view.shift = header->grid_shift;
+            grid_view.rows = header->grid_rows;
+            grid_view.cols = header->grid_cols;
+            grid_view.cell_offsets = section<std::uint32_t>(base, size, H::GRID_OFFSETS, cells + 1);
+            grid_view.items = section<SpaceId>(base, size, H::GRID_ITEMS, header->num_grid_items);
+            if (grid_view.cell_offsets[0] != 0 || grid_view.cell_offsets[cells] != header->num_grid_items) {
+                throw std::runtime_error("DungeonView: Bad grid offsets!");
+            }
+            for (std::size_t i=0; i<cells; ++i) {
+                if (grid_view.cell_offsets[i] > grid_view.cell_offsets[i+1]) {
+                    throw std::runtime_error("DungeonView: Bad grid offsets!");
+                }
+            }
+            for (SpaceId id : grid_view.items) {
+                if (id >= n) {
+                    throw std::runtime_error("DungeonView: Bad grid item!");
+                }
+            }
+        }
+    }
+
+    // The stored spatial index, empty if there was none. Its queries take
+    // this view as their table.
+    SpaceGridView const& grid() const {
+        return grid_view;
+    }
+
+    int num_cols() const {
+        return header->width;
+    }
+
+    int num_rows() const {
+        return header->height;
+    }
+
+    std::uint64_t get_seed() const {
+        return header->seed;
+    }
+
+    DungeonParams get_params() const {
+        DungeonParams rv;
+        rv.room_width_min = header->room_width_min;
+        rv.room_height_min = header->room_height_min;
+        rv.room_ratio_min = header->room_ratio_min;
+        rv.depth_max = header->depth_max;
+        return rv;
+    }
+
+    std::size_t size() const {
+        return header->num_spaces;
+    }
+
+    SpaceType type(std::size_t i) const {
+        return (dir[i] == Dir::NONE ? SpaceType::ROOM : SpaceType::HALL);
+    }
+
+    Rect rect(std::size_t i) const {
+        return Rect{begin_r[i], end_r[i], begin_c[i], end_c[i]};
+    }
+
+    ArrayView<SpaceId const> neighbors(SpaceId id) const {
+        assert(id < size());
+        return ArrayView<SpaceId const>(
+            edge_targets.begin() + edge_offsets[id],
+            edge_targets.begin() + edge_offsets[id+1]);
+    }
+};
+
+// Read-only memory map of a whole file.
+class MappedFile {
+    void const* ptr = nullptr;
+    std::size_t len = 0;
+#ifdef __MINGW32__
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+
+    void close() {
+#ifdef __MINGW32__
+        if (ptr) {
+            UnmapViewOfFile(ptr);
+        }
+        if (mapping) {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+        file = INVALID_HANDLE_VALUE;
+        mapping = nullptr;
+#else
+        if (ptr) {
+            munmap(const_cast<void*>(ptr), len);
+        }
+#endif
+        ptr = nullptr;
+        len = 0;
+    }
+
+public:
+
+    MappedFile() = default;
+
+    explicit MappedFile(std::string const& path) {
+#ifdef __MINGW32__
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER sz;
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &sz)) {
+            close();
+            throw std::runtime_error("MappedFile: Cannot open " + path);
+        }
+        len = std::size_t(sz.QuadPart);
+        if (len > 0) {
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            ptr = (mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr);
+            if (!ptr) {
+                close();
+                throw std::runtime_error("MappedFile: Cannot map " + path);
+            }
+        }
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            throw std::runtime_error("MappedFile: Cannot open " + path);
+        }
+        len = std::size_t(st.st_size);
+        if (len > 0) {
+            void* p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                len = 0;
+                throw std::runtime_error("MappedFile: Cannot map " + path);
+            }
+            ptr = p;
+        }
+        ::close(fd);
+#endif
+    }
+
+    MappedFile(MappedFile&& other) {
+        *this = std::move(other);
+    }
+
+    MappedFile& operator=(MappedFile&& other) {
+        if (this != &other) {
+            close();
+            std::swap(ptr, other.ptr);
+            std::swap(len, other.len);
+#ifdef __MINGW32__
+            std::swap(file, other.file);
+            std::swap(mapping, other.mapping);
+#endif
+        }
+        return *this;
+    }
+
+    ~MappedFile() {
+        close();
+    }
+
+    void const* data() const {
+        return ptr;
+    }
+
+    std::size_t size() const {
+        return len;
+    }
+};
+
+// Dungeon file built in memory, with a view over it.
+class DungeonBlob {
+    std::unique_ptr<unsigned char[]> storage;
+    unsigned char* base = nullptr;
+    std::size_t len = 0;
+    DungeonView dview;
+
+public:
+
+    template <typename Engine, typename Config>
+    explicit DungeonBlob(BasicDungeon<Engine,Config> const& dung) {
+        using H = DungeonFileHeader;
+        len = dungeon_file_header(dung).file_size;
+        storage.reset(new unsigned char[len + H::section_align - 1]);
+        auto addr = reinterpret_cast<std::uintptr_t>(storage.get());
+        base = storage.get() + (H::section_align - addr % H::section_align) % H::section_align;
+
+        unsigned char* pos = base;
+        write_dungeon_bytes(dung, [&](void const* bytes, std::size_t size){
+            std::memcpy(pos, bytes, size);
+            pos += size;
+        });
+        dview = DungeonView(base, len);
+    }
+
+    DungeonView const& view() const {
+        return dview;
+    }
+
+    void const* data() const {
+        return base;
+    }
+
+    std::size_t size() const {
+        return len;
+    }
+
+    // Heap bytes held, including alignment slack.
+    std::size_t footprint() const {
+        return len + DungeonFileHeader::section_align - 1;
+    }
+};
+
+#endif // DUNGEON_FILE_HPP
@@ -0,0 +1,110 @@
+#ifndef DUNGEON_STATS_HPP
+#define DUNGEON_STATS_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// What one Dungeon::go() did, for telling why a call was slow.
+// Counting is compiled out when DUNGEON_STATS_OFF is defined, leaving every
+// field at zero.
+struct DungeonStats {
+    enum Phase {
+        OTHER,
+        SPLIT,   // Rolling splits and merging halves.
+        ROOMS,   // Placing leaf rooms.
+        HALLS,   // Carving halls and junctions.
+        NUM_PHASES,
+    };
+
+    std::size_t split_attempts = 0;
+    std::size_t split_failures = 0;
+    std::size_t junctions = 0;
+    std::size_t spaces_added = 0;
+    std::size_t retries = 0;
+    std::size_t cache_high_water = 0;
+    int max_depth = 0;
+
+    // Time in each phase, not counting nested phases.
+    std::uint64_t phase_ns[NUM_PHASES] = {};
+
+    // Adds the counts of a part carved elsewhere, like a parallel job.
+    void merge(DungeonStats const& other) {
+        split_attempts += other.split_attempts;
+        split_failures += other.split_failures;
+        junctions += other.junctions;
+        spaces_added += other.spaces_added;
+        retries += other.retries;
+        cache_high_water = std::max(cache_high_water, other.cache_high_water);
+        max_depth = std::max(max_depth, other.max_depth);
+        for (int p=0; p<NUM_PHASES; ++p) {
+            phase_ns[p] += other.phase_ns[p];
+        }
+    }
+};
+
+// Charges the time while it's alive to one phase of a DungeonStats,
+// pausing the phase that was running before it.
+class DungeonPhaseTimer {
+    using Clock = std::chrono::steady_clock;
+
+public:
+
+    // The running phase, kept next to the stats it is charged to.
+    struct State {
+        DungeonStats::Phase phase = DungeonStats::OTHER;
+        int nesting = 0;
+        Clock::time_point mark;
+    };
+
+private:
+
+    DungeonStats& stats;
+    State& state;
+    DungeonStats::Phase prev;
+
+    void charge(Clock::time_point now) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - state.mark).count();
+        stats.phase_ns[state.phase] += std::uint64_t(ns);
+    }
+
+public:
+
+    DungeonPhaseTimer(DungeonStats& stats, State& state, DungeonStats::Phase phase)
+        : stats(stats), state(state), prev(state.phase) {
+        auto now = Clock::now();
+        if (state.nesting++ > 0) {
+            charge(now);
+        }
+        state.mark = now;
+        state.phase = phase;
+    }
+
+    ~DungeonPhaseTimer() {
+        auto now = Clock::now();
+        charge(now);
+        state.mark = now;
+        state.phase = prev;
+        --state.nesting;
+    }
+
+    DungeonPhaseTimer(DungeonPhaseTimer const&) = delete;
+    DungeonPhaseTimer& operator=(DungeonPhaseTimer const&) = delete;
+};
+
+#ifndef DUNGEON_STATS_OFF
+
+    #define dungeon_stat_count(field) (++stats.field)
+    #define dungeon_stat_max(field, value) (stats.field = std::max(stats.field, decltype(stats.field)(value)))
+    #define dungeon_stat_phase(phase) DungeonPhaseTimer _phase_timer_##phase (stats, phase_state, DungeonStats::phase)
+
+#else
+
+    #define dungeon_stat_count(field) ((void)0)
+    #define dungeon_stat_max(field, value) ((void)0)
+    #define dungeon_stat_phase(phase) ((void)0)
+
+#endif
+
+#endif // DUNGEON_STATS_HPP
@@ -1,6 +1,16 @@
 #include "dungeon.hpp"
+#include "batch.hpp"
+#include "dungeon_file.hpp"
+#include "dungeon_cache.hpp"
 
 #include <iostream>
+#include <sstream>
+#include <fstream>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <tuple>
 using namespace std;
 
 #define TEST(B) (((B)&&(clog<<"PASS"<<endl,true))||(clog<<"FAIL: "<<__FILE__<<":"<<__LINE__<<endl,false))
@@ -30,6 +40,18 @@ struct DungeonTests {
         rv*=TEST(( addressof(rect.begin_r) == addressof(rect.begin_latitude(Dir::HORIZ))  ));
         rv*=TEST(( addressof(rect.end_r)   == addressof(rect.end_latitude(Dir::HORIZ))    ));
 
+        rv*=TEST(( addressof(rect.begin_r) == addressof(rect.begin_longitude<Dir::VERT>())  ));
+        rv*=TEST(( addressof(rect.end_r)   == addressof(rect.end_longitude<Dir::VERT>())    ));
+        rv*=TEST(( addressof(rect.begin_c) == addressof(rect.begin_latitude<Dir::VERT>())   ));
+        rv*=TEST(( addressof(rect.end_c)   == addressof(rect.end_latitude<Dir::VERT>())     ));
+        rv*=TEST(( addressof(rect.begin_c) == addressof(rect.begin_longitude<Dir::HORIZ>()) ));
+        rv*=TEST(( addressof(rect.end_c)   == addressof(rect.end_longitude<Dir::HORIZ>())   ));
+        rv*=TEST(( addressof(rect.begin_r) == addressof(rect.begin_latitude<Dir::HORIZ>())  ));
+        rv*=TEST(( addressof(rect.end_r)   == addressof(rect.end_latitude<Dir::HORIZ>())    ));
+
+        rv*=TEST(( rect.split<Dir::VERT>(15) == rect.split(Dir::VERT, 15) ));
+        rv*=TEST(( rect.split<Dir::HORIZ>(20) == rect.split(Dir::HORIZ, 20) ));
+
         rv*=TEST(( rect.width() == (ec-bc) ));
         rv*=TEST(( rect.height() == (er-br) ));
 
@@ -97,42 +119,1128 @@ struct DungeonTests {
         return rv;
     }
 
+    bool test_space_table() {
+        dung.seed(3);
+        dung.go(60, 40);
+        dung.mult(2);
+
+        auto const& spaces = dung.get_spaces();
+        auto const& table = dung.get_table();
+
+        bool shapes_match = (table.size() == spaces.size());
+        bool found_all = true;
+        for (size_t i=0; i<spaces.size(); ++i) {
+            auto shape = get_shape(spaces[i]);
+            shapes_match = shapes_match && (table.rect(i) == shape) && (table.type(i) == spaces[i].type);
+            auto found = table.find(shape.begin_r, shape.begin_c);
+            found_all = found_all && found >= 0 && table.rect(found).contains(Rect{shape.begin_r, shape.begin_r+1, shape.begin_c, shape.begin_c+1});
+        }
+
+        bool rv = true;
+        rv*=TEST(( shapes_match ));
+        rv*=TEST(( found_all ));
+        rv*=TEST(( table.find(-1, -1) == -1 ));
+        return rv;
+    }
+
+    bool test_transform() {
+        dung.seed(5);
+        dung.go(70, 50);
+        auto const orig = dung.print_tiles();
+        dung.mult(3);
+        dung.sub(1);
+        dung.mult(2);
+        auto const stepwise = dung.print_tiles();
+
+        Dungeon fused;
+        fused.seed(5);
+        fused.go(70, 50);
+        fused.transform(Transform(fused.num_cols(), fused.num_rows()).mult(3).sub(1).mult(2));
+
+        auto simd = fused.get_table();
+        auto scalar = fused.get_table();
+        Transform xf (fused.num_cols(), fused.num_rows());
+        xf.transpose().flip_rows().translate(3, -2).flip_cols();
+        xf.apply(simd);
+        xf.apply_scalar(scalar);
+
+        Dungeon turned;
+        turned.seed(5);
+        turned.go(70, 50);
+        turned.transform(Transform(turned.num_cols(), turned.num_rows()).transpose().flip_rows());
+        auto const tiles = turned.print_tiles();
+
+        bool turned_ok = (tiles.size() == orig[0].size() && tiles[0].size() == orig.size());
+        for (size_t r=0; turned_ok && r<tiles.size(); ++r) {
+            for (size_t c=0; c<tiles[r].size(); ++c) {
+                char t = orig[c][tiles.size()-1-r];
+                t = (t == '-' ? '|' : t == '|' ? '-' : t);
+                turned_ok = turned_ok && (tiles[r][c] == t);
+            }
+        }
+
+        bool rv = true;
+        rv*=TEST(( fused.print_tiles() == stepwise ));
+        rv*=TEST(( simd.begin_r == scalar.begin_r && simd.end_r == scalar.end_r ));
+        rv*=TEST(( simd.begin_c == scalar.begin_c && simd.end_c == scalar.end_c ));
+        rv*=TEST(( simd.dir == scalar.dir ));
+        rv*=TEST(( turned_ok ));
+        return rv;
+    }
+
+    bool test_raster() {
+        dung.seed(9);
+        dung.go(100, 70);
+        auto const text = dung.print_tiles();
+
+        vector<unsigned char> bytes (dung.num_rows() * 128);
+        dung.rasterize(bytes.data(), 128);
+
+        PackedTiles packed;
+        dung.rasterize(packed);
+
+        bool bytes_ok = true;
+        bool packed_ok = (packed.width() == dung.num_cols() && packed.height() == dung.num_rows());
+        for (int r=0; r<dung.num_rows(); ++r) {
+            for (int c=0; c<dung.num_cols(); ++c) {
+                Tile t = Tile(bytes[r*128 + c]);
+                bytes_ok = bytes_ok && (text_palette[t] == text[r][c]);
+                packed_ok = packed_ok && (packed.get(r, c) == t);
+            }
+        }
+
+        ostringstream rendered;
+        render_text(packed, rendered);
+        string joined;
+        for (auto& l : text) {
+            joined += l + "\n";
+        }
+
+        bool rv = true;
+        rv*=TEST(( bytes_ok ));
+        rv*=TEST(( packed_ok ));
+        rv*=TEST(( rendered.str() == joined ));
+        return rv;
+    }
+
+    bool test_band_streaming() {
+        dung.seed(11);
+        dung.go(90, 61);
+        string joined;
+        for (auto& l : dung.print_tiles()) {
+            joined += l + "\n";
+        }
+
+        BandRasterizer rast;
+        bool rv = true;
+        for (int band_rows : {1, 7, 64}) {
+            ostringstream out;
+            int next_row = 0;
+            bool in_order = true;
+            auto sink = ostream_sink(out);
+            dung.stream_tiles(rast, band_rows, [&](int first, int rows, unsigned char const* tiles, size_t stride){
+                in_order = in_order && (first == next_row);
+                next_row = first + rows;
+                sink(first, rows, tiles, stride);
+            }, text_palette);
+            rv*=TEST(( in_order && next_row == dung.num_rows() ));
+            rv*=TEST(( out.str() == joined ));
+        }
+        return rv;
+    }
+
+    bool test_binary_file() {
+        DungeonParams params;
+        params.room_height_min = 4;
+        dung.set_params(params);
+        dung.seed(13);
+        dung.go(80, 45);
+
+        char const* path = "dungeon_test.bin";
+        {
+            ofstream out (path, ios::binary);
+            write_dungeon(dung, out);
+        }
+        dung.set_params(DungeonParams{});
+        MappedFile file (path);
+        DungeonView view (file.data(), file.size());
+
+        vector<unsigned char> expected (80 * 45);
+        vector<unsigned char> loaded (80 * 45);
+        dung.rasterize(expected.data(), 80);
+        rasterize(view, view.num_cols(), view.num_rows(), loaded.data(), 80);
+
+        bool neighbors_match = (view.size() == dung.get_spaces().size());
+        for (SpaceId id=0; neighbors_match && id<view.size(); ++id) {
+            auto a = dung.neighbors(id);
+            auto b = view.neighbors(id);
+            neighbors_match = equal(a.begin(), a.end(), b.begin(), b.end()) && (view.rect(id) == dung.get_table().rect(id));
+        }
+
+        bool rejected = false;
+        try {
+            vector<unsigned char> junk (file.size());
+            DungeonView bad (junk.data() + 1, junk.size() - 1);
+        } catch (runtime_error const&) {
+            rejected = true;
+        }
+
+        // Edge sections are checked once, on load, so neighbors() can't
+        // hand out ids past the space table.
+        auto corrupt = [&](int section, size_t i, uint32_t value){
+            vector<unsigned char> copy (file.size() + DungeonFileHeader::section_align);
+            auto addr = reinterpret_cast<uintptr_t>(copy.data());
+            auto base = copy.data() + (DungeonFileHeader::section_align - addr % DungeonFileHeader::section_align) % DungeonFileHeader::section_align;
+            memcpy(base, file.data(), file.size());
+            auto header = reinterpret_cast<DungeonFileHeader const*>(base);
+            memcpy(base + header->section_offset[section] + i * sizeof(uint32_t), &value, sizeof(value));
+            try {
+                DungeonView bad (base, file.size());
+            } catch (runtime_error const&) {
+                return true;
+            }
+            return false;
+        };
+        bool bad_edges = (
+            corrupt(DungeonFileHeader::EDGE_TARGETS, 0, uint32_t(view.size())) &&
+            corrupt(DungeonFileHeader::EDGE_OFFSETS, 1, uint32_t(view.neighbors(0).size() + view.neighbors(1).size() + 1)));
+
+        bool rv = true;
+        rv*=TEST(( view.num_cols() == 80 && view.num_rows() == 45 ));
+        rv*=TEST(( view.get_seed() == 13 && view.get_params().room_height_min == 4 ));
+        rv*=TEST(( loaded == expected ));
+        rv*=TEST(( neighbors_match ));
+        rv*=TEST(( rejected ));
+        rv*=TEST(( bad_edges ));
+
+        file = MappedFile();
+        remove(path);
+        return rv;
+    }
+
+    bool test_dungeon_cache() {
+        Dungeon fresh;
+        fresh.seed(21);
+        fresh.go(60, 40);
+        DungeonBlob blob (fresh);
+
+        DungeonCache cache (blob.footprint() * 2 + blob.footprint() / 2);
+        auto a = cache.get(21, 60, 40);
+        auto b = cache.get(22, 60, 40);
+        auto a2 = cache.get(21, 60, 40);
+        auto c = cache.get(23, 60, 40);
+        auto b2 = cache.get(22, 60, 40);
+        auto stats = cache.stats();
+
+        // Seeds are keyed on all their bits.
+        DungeonCache wide (blob.footprint() * 3);
+        wide.get(21, 60, 40);
+        wide.get(21 + (uint64_t(1) << 32), 60, 40);
+        bool wide_keys = (wide.stats().misses == 2);
+
+        vector<unsigned char> expected (60 * 40);
+        vector<unsigned char> cached (60 * 40);
+        fresh.rasterize(expected.data(), 60);
+        rasterize(a->view(), 60, 40, cached.data(), 60);
+
+        bool rv = true;
+        rv*=TEST(( a == a2 && b != b2 ));
+        rv*=TEST(( cached == expected ));
+        rv*=TEST(( stats.hits == 1 && stats.misses == 4 && stats.evictions == 2 ));
+        rv*=TEST(( stats.entries == 2 && stats.bytes <= blob.footprint() * 5 / 2 ));
+        rv*=TEST(( wide_keys ));
+        return rv;
+    }
+
+    bool test_generation_stats() {
+        Dungeon par;
+        par.set_parallel(nullptr, 2);
+
+        // Starting with room for one space forces retries, which must
+        // neither change the map nor count the discarded tries.
+        Dungeon retried;
+        Dungeon retried_par;
+        retried_par.set_parallel(nullptr, 2);
+        retried.rooms_reserve_max = 1;
+        retried_par.rooms_reserve_max = 1;
+
+        bool rv = true;
+        for (Dungeon* d : {&dung, &par, &retried, &retried_par}) {
+            d->seed(17);
+            d->go(120, 80);
+
+            auto const& st = d->get_stats();
+            auto const& spaces = d->get_spaces();
+            auto rooms = size_t(count_if(spaces.begin(), spaces.end(), [](Space const& sp){
+                return sp.type == SpaceType::ROOM;
+            }));
+            auto splits = st.split_attempts - st.split_failures;
+
+#ifndef DUNGEON_STATS_OFF
+            // Junctions are rooms, and each one also splits a hall in two.
+            rv*=TEST(( splits + 1 + st.junctions == rooms ));
+            rv*=TEST(( rooms + splits + st.junctions == spaces.size() ));
+            rv*=TEST(( st.spaces_added == spaces.size() ));
+            rv*=TEST(( st.max_depth > 1 && st.max_depth <= d->get_params().depth_max ));
+            rv*=TEST(( st.cache_high_water > 0 ));
+#else
+            rv*=TEST(( splits == 0 && st.junctions == 0 && st.spaces_added == 0 && rooms > 0 ));
+#endif
+        }
+
+#ifndef DUNGEON_STATS_OFF
+        rv*=TEST(( retried.get_stats().retries > 0 && retried_par.get_stats().retries > 0 ));
+#endif
+        rv*=TEST(( retried.print_tiles() == dung.print_tiles() && retried_par.print_tiles() == par.print_tiles() ));
+        return rv;
+    }
+
+    bool test_cache_bound() {
+        Dungeon wide;
+        bool fits = true;
+        for (int s=1; s<=20; ++s) {
+            wide.seed(s);
+            wide.go(600, 40);
+#ifndef DUNGEON_STATS_OFF
+            fits = fits && (wide.get_stats().cache_high_water <= size_t(wide.cache.size()));
+#endif
+        }
+
+        // Working out the bound takes time in the levels only, so deep trees,
+        // changing sizes and jobs at every depth don't slow go() down.
+        DungeonParams deep_params;
+        deep_params.depth_max = 30;
+        Dungeon deep;
+        deep.set_params(deep_params);
+        deep.set_parallel(nullptr, 3);
+        bool deep_fits = true;
+        auto start = chrono::steady_clock::now();
+        for (int s=1; s<=6; ++s) {
+            deep.seed(s);
+            deep.go(256 - s%2, 256);
+#ifndef DUNGEON_STATS_OFF
+            deep_fits = deep_fits && (deep.get_stats().cache_high_water <= size_t(deep.cache.size()));
+#endif
+            deep_fits = deep_fits && (size_t(deep.cache.size()) <= size_t(256 * (deep_params.depth_max-1) * 2));
+        }
+        auto elapsed = chrono::steady_clock::now() - start;
+
+        // The old bound was max(w,h) for every level of the tree.
+        bool rv = true;
+        rv*=TEST(( fits ));
+        rv*=TEST(( size_t(wide.cache.size()) * 8 < size_t(600 * (wide.get_params().depth_max-1) * 2) ));
+        rv*=TEST(( deep_fits ));
+        rv*=TEST(( elapsed < chrono::seconds(2) ));
+        return rv;
+    }
+
+    bool test_deep_generation() {
+        DungeonParams params;
+        params.room_ratio_min = 0.05;
+        params.depth_max = 200;
+
+        Dungeon deep;
+        deep.set_params(params);
+        deep.seed(1);
+        deep.go(4000, 8);
+        auto count = deep.allocation_count();
+
+        // Long and thin, so splits nest below the default depth_max.
+        size_t tree_depth = 0;
+        bool fits = true;
+        for (int s=2; s<=4; ++s) {
+            deep.seed(s);
+            deep.go(4000, 8);
+            auto tree = deep.get_tree();
+            vector<size_t> depths (tree.size(), 1);
+            for (size_t i=0; i<depths.size(); ++i) {
+                tree_depth = max(tree_depth, depths[i]);
+                if (tree[i].dir != Dir::NONE) {
+                    depths[tree[i].children[0]] = depths[i] + 1;
+                    depths[tree[i].children[1]] = depths[i] + 1;
+                }
+            }
+            fits = fits && (deep.carve_stack.size() == 0 && deep.carve_stack.capacity() > tree_depth);
+        }
+
+        bool rv = true;
+        rv*=TEST(( tree_depth > size_t(DungeonParams{}.depth_max) ));
+        rv*=TEST(( fits ));
+        rv*=TEST(( deep.allocation_count() == count ));
+        return rv;
+    }
+
+    bool test_rng_engines() {
+        // Reference outputs from the authors' implementations.
+        Pcg32 pcg (42, 54);
+        auto p0 = pcg();
+        auto p1 = pcg();
+        auto p2 = pcg();
+        SplitMix64 sm (0);
+        auto s0 = sm();
+        auto s1 = sm();
+
+        Xoshiro256ss xo (7);
+        int counts[7] = {};
+        bool in_range = true;
+        for (int i=0; i<70000; ++i) {
+            int x = uniform_int(xo, 3, 9);
+            in_range = in_range && (x >= 3 && x <= 9);
+            if (x >= 3 && x <= 9) {
+                ++counts[x-3];
+            }
+        }
+        bool even = true;
+        for (int c : counts) {
+            even = even && (c > 9000 && c < 11000);
+        }
+
+        // Jobs seed their engines from the dungeon's, with any engine.
+        Dungeon::Workers tw;
+        BasicDungeon<Xoshiro256ss> par;
+        BasicDungeon<Xoshiro256ss> inl;
+        par.set_parallel(&tw, 2);
+        inl.set_parallel(nullptr, 2);
+        bool same = true;
+        for (int s=1; s<=4; ++s) {
+            par.seed(s);
+            par.go(100, 70);
+            inl.seed(s);
+            inl.go(100, 70);
+            same = same && (par.print_tiles() == inl.print_tiles());
+        }
+
+        BasicDungeon<Pcg32> a;
+        BasicDungeon<Pcg32> b;
+        a.seed(5);
+        a.go(80, 60);
+        b.seed(5);
+        b.go(80, 60);
+
+        bool rv = true;
+        rv*=TEST(( p0 == 0xa15c02b7u && p1 == 0x7b47f409u && p2 == 0xba1d3330u ));
+        rv*=TEST(( s0 == 0xe220a8397b1dcdafull && s1 == 0x6e789e6aa1b965f4ull ));
+        rv*=TEST(( in_range && even ));
+        rv*=TEST(( same ));
+        rv*=TEST(( a.print_tiles() == b.print_tiles() && a.get_spaces().size() > 1 ));
+        return rv;
+    }
+
+    bool test_fixed_params() {
+        using Default = FixedParams<3, 3, ratio<3,10>, 15>;
+        using Small = FixedParams<4, 5, ratio<1,4>, 10, 128>;
+
+        // Fixed params carve the maps of the same runtime params.
+        Dungeon dyn;
+        BasicDungeon<mt19937, Default> fixed;
+        bool same = true;
+        for (int s=1; s<=6; ++s) {
+            dyn.seed(s);
+            dyn.go(120, 90);
+            fixed.seed(s);
+            fixed.go(120, 90);
+            same = same && (dyn.print_tiles() == fixed.print_tiles());
+        }
+
+        DungeonParams params;
+        params.room_width_min = 4;
+        params.room_height_min = 5;
+        params.room_ratio_min = 0.25;
+        params.depth_max = 10;
+        dyn.set_params(params);
+        dyn.set_parallel(nullptr, 2);
+        BasicDungeon<mt19937, Small> small;
+        small.set_parallel(nullptr, 2);
+        bool same_small = true;
+        for (int s=1; s<=6; ++s) {
+            dyn.seed(s);
+            dyn.go(128, 100);
+            small.seed(s);
+            small.go(128, 100);
+            same_small = same_small && (dyn.print_tiles() == small.print_tiles());
+        }
+        bool own_cache = (small.cache.begin() == small.cache_storage.data());
+
+        // Exact ratios don't round down where the double's products land
+        // just below an integer, so 7/10 carves other maps on some seeds.
+        using Sevenths = FixedParams<3, 3, ratio<7,10>, 15>;
+        DungeonParams seven;
+        seven.room_ratio_min = 0.7;
+        Dungeon dyn7;
+        dyn7.set_params(seven);
+        BasicDungeon<mt19937, Sevenths> fixed7;
+        dyn7.seed(123);
+        dyn7.go(180, 90);
+        fixed7.seed(123);
+        fixed7.go(180, 90);
+        bool rounds = (seven.times_ratio(90) == 62 && Sevenths::times_ratio(90) == 63);
+        bool differs = (dyn7.print_tiles() != fixed7.print_tiles());
+
+        bool throws = false;
+        try {
+            small.set_params(DungeonParams{});
+        } catch (logic_error const&) {
+            throws = true;
+        }
+        small.set_params(params);
+
+        bool rv = true;
+        rv*=TEST(( same ));
+        rv*=TEST(( same_small ));
+        rv*=TEST(( own_cache ));
+        rv*=TEST(( rounds && differs ));
+        rv*=TEST(( small.get_params() == params && fixed.get_params() == DungeonParams{} ));
+        rv*=TEST(( throws ));
+        return rv;
+    }
+
+    bool test_counter_rng() {
+        Dungeon::Workers tw;
+        Dungeon serial;
+        Dungeon par;
+        Dungeon inl;
+        Dungeon seq;
+        serial.set_counter_rng(true);
+        par.set_counter_rng(true);
+        inl.set_counter_rng(true);
+        par.set_parallel(&tw, 3);
+        inl.set_parallel(nullptr, 2);
+
+        // Any split of the work gives the same dungeon.
+        bool same = true;
+        bool differs = false;
+        for (int s=1; s<=6; ++s) {
+            for (Dungeon* d : {&serial, &par, &inl, &seq}) {
+                d->seed(s);
+                d->go(110, 75);
+            }
+            auto tiles = serial.print_tiles();
+            same = same && (par.print_tiles() == tiles && inl.print_tiles() == tiles);
+            differs = differs || (seq.print_tiles() != tiles);
+        }
+
+        // Every bit of the seed counts, and files keep all of them.
+        uint64_t const high = uint64_t(1) << 32;
+        serial.seed(0);
+        serial.go(110, 75);
+        auto low_tiles = serial.print_tiles();
+        serial.seed(high);
+        serial.go(110, 75);
+        bool wide_seed = (serial.get_seed() == high && serial.print_tiles() != low_tiles);
+        wide_seed = wide_seed && (DungeonBlob(serial).view().get_seed() == high);
+
+        // Draws at a node don't depend on what was drawn before.
+        serial.seed(3);
+        auto a = serial.roll_rng(5, Dungeon::DRAW_SPLIT, 0, 1000);
+        serial.roll_rng(6, Dungeon::DRAW_HALL, 0, 1000);
+        auto b = serial.roll_rng(5, Dungeon::DRAW_SPLIT, 0, 1000);
+        auto c = serial.roll_rng(5, Dungeon::DRAW_HALL, 0, 1000);
+
+        bool rv = true;
+        rv*=TEST(( same ));
+        rv*=TEST(( differs ));
+        rv*=TEST(( wide_seed ));
+        rv*=TEST(( a == b && a != c ));
+        return rv;
+    }
+
+    bool test_level_generation() {
+        Dungeon::Workers tw;
+        Dungeon serial;
+        Dungeon levels;
+        Dungeon pooled;
+        serial.set_counter_rng(true);
+        levels.set_counter_rng(true);
+        pooled.set_counter_rng(true);
+        pooled.set_parallel(&tw, 0);
+
+        auto same_tree = [](Dungeon const& a, Dungeon const& b){
+            auto ta = a.get_tree();
+            auto tb = b.get_tree();
+            if (ta.size() != tb.size()) {
+                return false;
+            }
+            for (size_t i=0; i<size_t(ta.size()); ++i) {
+                if (ta[i].dir != tb[i].dir || ta[i].space_begin != tb[i].space_begin || ta[i].space_end != tb[i].space_end) {
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        // Deciding a level at a time gives the same dungeon as go().
+        bool same = true;
+        for (int s=1; s<=6; ++s) {
+            for (auto wh : {make_pair(110, 75), make_pair(40, 90), make_pair(400, 300)}) {
+                serial.seed(s);
+                serial.go(wh.first, wh.second);
+                levels.seed(s);
+                levels.go_levels(wh.first, wh.second);
+                pooled.seed(s);
+                pooled.go_levels(wh.first, wh.second);
+                auto tiles = serial.print_tiles();
+                same = same && (levels.print_tiles() == tiles && pooled.print_tiles() == tiles);
+                same = same && (levels.get_spaces().size() == serial.get_spaces().size());
+                same = same && same_tree(levels, serial) && same_tree(pooled, serial);
+            }
+        }
+
+        // Warm runs of the same size don't allocate.
+        levels.seed(9);
+        levels.go_levels(400, 300);
+        auto count = levels.allocation_count();
+        levels.seed(10);
+        levels.go_levels(400, 300);
+
+        // Draws would depend on their order with an engine.
+        Dungeon engine;
+        bool threw = false;
+        try {
+            engine.go_levels(110, 75);
+        } catch (logic_error const&) {
+            threw = true;
+        }
+
+        bool rv = true;
+        rv*=TEST(( same ));
+        rv*=TEST(( levels.allocation_count() == count ));
+        rv*=TEST(( threw ));
+        return rv;
+    }
+
+    bool test_region_generation() {
+        auto key = [](Space const& sp){
+            auto r = get_shape(sp);
+            return make_tuple(int(sp.type), r.begin_r, r.end_r, r.begin_c, r.end_c);
+        };
+        using Key = decltype(key(Space{}));
+
+        auto make = [](Dungeon& d){
+            d.set_counter_rng(true);
+            d.set_region_chunk(24);
+            d.seed(7);
+        };
+
+        // Neighbors by shape, for comparing spaces across dungeons.
+        auto graph = [&](Dungeon const& d){
+            map<Key,vector<Key>> rv;
+            auto const& sps = d.get_spaces();
+            for (SpaceId i : number_range(SpaceId(0),SpaceId(sps.size()))) {
+                auto& ns = rv[key(sps[i])];
+                for (SpaceId n : d.neighbors(i)) {
+                    ns.push_back(key(sps[n]));
+                }
+                sort(ns.begin(), ns.end());
+            }
+            return rv;
+        };
+
+        int const w = 300;
+        int const h = 200;
+
+        Dungeon full;
+        make(full);
+        full.go_region(w, h, Rect{0, h, 0, w});
+        auto full_graph = graph(full);
+
+        // Spaces don't overlap, and are all connected.
+        vector<int> cover (size_t(w) * h, 0);
+        bool disjoint = true;
+        for (Space const& sp : full.get_spaces()) {
+            auto r = get_shape(sp);
+            for (int i=r.begin_r; i<r.end_r; ++i) {
+                for (int j=r.begin_c; j<r.end_c; ++j) {
+                    disjoint = disjoint && (++cover[size_t(i)*w + j] == 1);
+                }
+            }
+        }
+
+        vector<bool> seen (full.get_spaces().size(), false);
+        vector<SpaceId> stack {0};
+        seen[0] = true;
+        while (!stack.empty()) {
+            auto id = stack.back();
+            stack.pop_back();
+            for (SpaceId n : full.neighbors(id)) {
+                if (!seen[n]) {
+                    seen[n] = true;
+                    stack.push_back(n);
+                }
+            }
+        }
+        bool connected = all_of(seen.begin(), seen.end(), [](bool b){ return b; });
+
+        // Every region has the same spaces as the whole map there.
+        Dungeon::Workers tw;
+        Dungeon part;
+        make(part);
+        part.set_parallel(&tw, 0);
+        bool same = true;
+        bool smaller = true;
+        for (Rect q : {Rect{0, 40, 0, 50}, Rect{90, 130, 140, 230}, Rect{150, 200, 260, 300}}) {
+            part.go_region(w, h, q);
+            auto part_graph = graph(part);
+            for (auto const& kv : part_graph) {
+                auto iter = full_graph.find(kv.first);
+                same = same && iter != full_graph.end() && includes(
+                    iter->second.begin(), iter->second.end(),
+                    kv.second.begin(), kv.second.end());
+            }
+            for (Space const& sp : full.get_spaces()) {
+                if (get_shape(sp).intersects(q)) {
+                    same = same && part_graph.count(key(sp)) == 1;
+                }
+            }
+            smaller = smaller && part.get_spaces().size() < full.get_spaces().size();
+        }
+
+        // A small query on a huge map only expands the nodes above it.
+        Dungeon huge;
+        make(huge);
+        DungeonParams params;
+        params.depth_max = 48;
+        huge.set_params(params);
+        huge.go_region(1000000, 1000000, Rect{500000, 500100, 500000, 500100});
+        auto nodes = huge.get_region_nodes();
+        bool lazy = nodes.size() < 1000 && any_of(nodes.begin(), nodes.end(), [](auto const& n){
+            return !n.expanded();
+        });
+
+        bool threw = false;
+        try {
+            Dungeon seq;
+            seq.go_region(w, h, Rect{0, h, 0, w});
+        } catch (logic_error const&) {
+            threw = true;
+        }
+
+        bool rv = true;
+        rv*=TEST(( disjoint ));
+        rv*=TEST(( connected ));
+        rv*=TEST(( same ));
+        rv*=TEST(( smaller ));
+        rv*=TEST(( lazy && !huge.get_spaces().empty() ));
+        rv*=TEST(( threw ));
+        return rv;
+    }
+
+    bool test_split_tree() {
+        // Point and rect queries agree with scanning every space.
+        auto agrees = [](Dungeon const& d){
+            auto const& sps = d.get_spaces();
+            bool rv = (d.get_tree()[0].space_end == sps.size());
+            for (int r=0; r<d.num_rows(); ++r) {
+                for (int c=0; c<d.num_cols(); ++c) {
+                    Space const* found = nullptr;
+                    for (Space const& sp : sps) {
+                        if (get_shape(sp).contains(Rect{r, r+1, c, c+1})) {
+                            found = &sp;
+                        }
+                    }
+                    rv = rv && d.locate(r, c) == found;
+                }
+            }
+            for (Rect q : {Rect{0, 10, 0, 10}, Rect{20, 45, 30, 90}, Rect{0, d.num_rows(), 0, d.num_cols()}}) {
+                size_t hits = 0;
+                d.query(q, [&](Space const& sp){
+                    rv = rv && get_shape(sp).intersects(q);
+                    ++hits;
+                });
+                rv = rv && hits == size_t(count_if(sps.begin(), sps.end(), [&](Space const& sp){
+                    return get_shape(sp).intersects(q);
+                }));
+            }
+            return rv;
+        };
+
+        Dungeon serial;
+        serial.seed(5);
+        serial.go(120, 80);
+
+        Dungeon par;
+        par.set_parallel(nullptr, 3);
+        par.seed(5);
+        par.go(120, 80);
+
+        Dungeon xf;
+        xf.seed(6);
+        xf.go(90, 70);
+        xf.transform(Transform(90, 70).mult(3).sub(1).flip_cols().transpose());
+
+        Dungeon region;
+        region.set_counter_rng(true);
+        region.set_region_chunk(24);
+        region.seed(5);
+        region.go_region(200, 150, Rect{40, 90, 60, 130});
+
+        size_t leaves = 0;
+        for (auto const& n : serial.get_tree()) {
+            leaves += (n.dir == Dir::NONE);
+        }
+
+        bool rv = true;
+        rv*=TEST(( agrees(serial) ));
+        rv*=TEST(( size_t(serial.get_tree().size()) == leaves*2 - 1 ));
+        rv*=TEST(( agrees(par) ));
+        rv*=TEST(( agrees(xf) ));
+        rv*=TEST(( agrees(region) ));
+        return rv;
+    }
+
+    bool test_spatial_index() {
+        Dungeon d;
+        d.set_spatial_index(true);
+        d.seed(9);
+        d.go(150, 100);
+
+        auto const& table = d.get_table();
+        auto const n = table.size();
+
+        // Each query reports every intersecting space exactly once.
+        auto matches = [&](SpaceGridView const& grid, auto const& tab, Rect q){
+            vector<int> hits (n, 0);
+            grid.query(tab, q, [&](SpaceId id){
+                ++hits[id];
+            });
+            bool rv = true;
+            for (SpaceId id=0; id<n; ++id) {
+                rv = rv && hits[id] == (table.rect(id).intersects(q) ? 1 : 0);
+            }
+            return rv;
+        };
+
+        vector<Rect> queries {
+            Rect{0, 100, 0, 150}, Rect{-5, 3, -5, 200}, Rect{37, 38, 52, 53}, Rect{10, 70, 20, 61}};
+        for (int i=0; i<40; ++i) {
+            int r = (i*37) % 100;
+            int c = (i*53) % 150;
+            queries.push_back(Rect{r, r + 1 + i % 23, c, c + 1 + (i*7) % 31});
+        }
+
+        bool same = true;
+        for (auto q : queries) {
+            same = same && matches(d.get_grid(), table, q);
+        }
+
+        bool located = true;
+        for (int r=0; r<100; ++r) {
+            for (int c=0; c<150; ++c) {
+                auto id = d.get_grid().locate(table, r, c);
+                bool in = false;
+                for (SpaceId i=0; i<n; ++i) {
+                    in = in || table.rect(i).contains(Rect{r, r+1, c, c+1});
+                }
+                located = located && (id == SpaceGridView::no_space ? !in : table.rect(id).contains(Rect{r, r+1, c, c+1}));
+            }
+        }
+
+        // A line inside a room sees through it; one into the wall around it doesn't.
+        auto room = table.rect(0);
+        bool seen = d.get_grid().trace(table, room.begin_r, room.begin_c, room.end_r-1, room.end_c-1, [](SpaceId){});
+        bool blocked = !d.get_grid().trace(table, room.begin_r, room.begin_c, room.end_r, room.end_c, [](SpaceId){});
+
+        // The index survives a round trip through a dungeon file.
+        DungeonBlob blob (d);
+        auto const& view = blob.view();
+        bool loaded = !view.grid().empty();
+        for (auto q : queries) {
+            loaded = loaded && matches(view.grid(), view, q);
+        }
+
+        // Spaces moved past the top left edge are still found, from the
+        // cells they clamp to.
+        Dungeon moved;
+        moved.set_spatial_index(true);
+        moved.seed(7);
+        moved.go(80, 60);
+        moved.transform(Transform(80, 60).translate(-3, -3));
+        auto found = [&](Rect q){
+            vector<Space const*> rv;
+            moved.query(q, [&](Space const& sp){
+                rv.push_back(&sp);
+            });
+            sort(rv.begin(), rv.end());
+            return rv;
+        };
+        Rect const edge {-10, 60, -10, 80};
+        auto by_grid = found(edge);
+        vector<Space const*> located_grid;
+        for (int r=-3; r<60; ++r) {
+            located_grid.push_back(moved.locate(r, -2));
+        }
+        moved.set_spatial_index(false);
+        bool clamped = (!by_grid.empty() && by_grid == found(edge));
+        for (int r=-3; r<60; ++r) {
+            clamped = clamped && (located_grid[r+3] == moved.locate(r, -2));
+        }
+
+        d.set_spatial_index(false);
+        d.go(150, 100);
+
+        bool rv = true;
+        rv*=TEST(( same ));
+        rv*=TEST(( clamped ));
+        rv*=TEST(( located ));
+        rv*=TEST(( seen && blocked ));
+        rv*=TEST(( loaded ));
+        rv*=TEST(( d.get_grid().empty() && DungeonBlob(d).view().grid().empty() ));
+        return rv;
+    }
+
+    bool test_reroll() {
+        auto make = [](Dungeon& d){
+            d.seed(4);
+            d.go(120, 80);
+        };
+
+        Dungeon d;
+        make(d);
+
+        // The second child's first child, and its rect.
+        auto tree = d.get_tree();
+        uint32_t idx = tree[tree[0].children[1]].children[0];
+        Rect rect {0, 80, 0, 120};
+        for (uint32_t i=0; i!=idx;) {
+            int which = (idx >= tree[i].children[1]);
+            auto halves = rect.split(tree[i].dir, tree[i].pos);
+            rect = (which ? halves.second : halves.first);
+            i = tree[i].children[which];
+        }
+
+        // Rooms away from the node, junctions aside.
+        auto outside = [&](Dungeon const& dung){
+            vector<tuple<int,int,int,int>> rv;
+            for (Space const& sp : dung.get_spaces()) {
+                auto r = get_shape(sp);
+                if (sp.type == SpaceType::ROOM && r.width()*r.height() > 1 && !r.intersects(rect)) {
+                    rv.emplace_back(r.begin_r, r.end_r, r.begin_c, r.end_c);
+                }
+            }
+            sort(rv.begin(), rv.end());
+            return rv;
+        };
+        auto const before = outside(d);
+        auto const old_tiles = d.print_tiles();
+
+        uint32_t seed = 1;
+        while (seed < 50 && !d.reroll(idx, seed)) {
+            ++seed;
+        }
+
+        bool disjoint = true;
+        vector<int> cover (120*80, 0);
+        for (Space const& sp : d.get_spaces()) {
+            auto r = get_shape(sp);
+            for (int i=r.begin_r; i<r.end_r; ++i) {
+                for (int j=r.begin_c; j<r.end_c; ++j) {
+                    disjoint = disjoint && (++cover[i*120 + j] == 1);
+                }
+            }
+        }
+
+        vector<bool> seen (d.get_spaces().size(), false);
+        vector<SpaceId> stack {0};
+        seen[0] = true;
+        while (!stack.empty()) {
+            auto id = stack.back();
+            stack.pop_back();
+            for (SpaceId n : d.neighbors(id)) {
+                if (!seen[n]) {
+                    seen[n] = true;
+                    stack.push_back(n);
+                }
+            }
+        }
+        bool connected = all_of(seen.begin(), seen.end(), [](bool b){ return b; });
+
+        bool located = (d.get_tree()[0].space_end == d.get_spaces().size());
+        for (int r=0; r<80; ++r) {
+            for (int c=0; c<120; ++c) {
+                Space const* found = nullptr;
+                for (Space const& sp : d.get_spaces()) {
+                    if (get_shape(sp).contains(Rect{r, r+1, c, c+1})) {
+                        found = &sp;
+                    }
+                }
+                located = located && d.locate(r, c) == found;
+            }
+        }
+
+        // The same reroll gives the same dungeon.
+        Dungeon again;
+        make(again);
+        bool repeat = again.reroll(idx, seed) && again.print_tiles() == d.print_tiles();
+
+        // Rerolling the root is generating with the new seed.
+        Dungeon root;
+        make(root);
+        Dungeon fresh;
+        fresh.seed(77);
+        fresh.go(120, 80);
+        bool whole = root.reroll(0, 77) && root.print_tiles() == fresh.print_tiles();
+
+        bool threw = false;
+        try {
+            root.mult(2);
+            root.reroll(0, 1);
+        } catch (logic_error const&) {
+            threw = true;
+        }
+
+        bool rv = true;
+        rv*=TEST(( seed < 50 ));
+        rv*=TEST(( outside(d) == before ));
+        rv*=TEST(( d.print_tiles() != old_tiles ));
+        rv*=TEST(( disjoint ));
+        rv*=TEST(( connected ));
+        rv*=TEST(( located ));
+        rv*=TEST(( repeat ));
+        rv*=TEST(( whole ));
+        rv*=TEST(( threw ));
+        return rv;
+    }
+
+    bool test_thread_worker() {
+        ThreadWorker<int> tw (2);
+
+        // Tasks waiting on their own subtasks must not deadlock.
+        auto outer = tw.do_task([&]{
+            auto inner = tw.do_task([]{ return 20; });
+            return inner.get() + 1;
+        });
+
+        auto bad = tw.do_task([]() -> int {
+            throw runtime_error("bad task");
+        });
+
+        bool threw = false;
+        try {
+            bad.get();
+        } catch (runtime_error const&) {
+            threw = true;
+        }
+
+        bool rv = true;
+        rv*=TEST(( outer.get() == 21 ));
+        rv*=TEST(( threw ));
+        return rv;
+    }
+
+    bool test_parallel_generation() {
+        Dungeon::Workers tw;
+        Dungeon par;
+        Dungeon inl;
+        par.set_parallel(&tw, 3);
+        inl.set_parallel(nullptr, 3);
+
+        bool rv = true;
+        for (int s=1; s<=8; ++s) {
+            par.seed(s);
+            par.go(120, 80);
+            inl.seed(s);
+            inl.go(120, 80);
+            rv*=TEST(( par.print_tiles() == inl.print_tiles() ));
+        }
+        return rv;
+    }
+
+    bool test_batch_generation() {
+        vector<unsigned> seeds;
+        for (unsigned s=1; s<=16; ++s) {
+            seeds.push_back(s);
+        }
+
+        DungeonParams params;
+        params.room_width_min = 4;
+
+        vector<vector<string>> batch (seeds.size());
+        generate_batch(seeds, 70, 50, params, [&](size_t i, unsigned, Dungeon const& d){
+            batch[i] = d.print_tiles();
+        }, 4);
+
+        bool rv = true;
+        Dungeon serial;
+        serial.set_params(params);
+        for (size_t i=0; i<seeds.size(); ++i) {
+            serial.seed(seeds[i]);
+            serial.go(70, 50);
+            rv*=TEST(( batch[i] == serial.print_tiles() ));
+        }
+        return rv;
+    }
+
+    bool test_warm_generation_allocates_nothing() {
+        Dungeon::Workers tw;
+        Dungeon serial;
+        Dungeon par;
+        par.set_parallel(&tw, 2);
+
+        serial.seed(1);
+        serial.go(90, 70);
+        par.seed(1);
+        par.go(90, 70);
+
+        auto serial_count = serial.allocation_count();
+        auto par_count = par.allocation_count();
+
+        for (int s=2; s<=10; ++s) {
+            serial.seed(s);
+            serial.go(90 - s, 70);
+            par.seed(s);
+            par.go(90, 70 - s);
+        }
+
+        bool rv = true;
+        rv*=TEST(( serial.allocation_count() == serial_count ));
+        rv*=TEST(( par.allocation_count() == par_count ));
+        return rv;
+    }
+
     bool run_all_tests() {
         bool rv = true;
         rv *= test_rect_axes();
         rv *= test_room_shape();
         rv *= test_vert_hall_shape();
         rv *= test_horiz_hall_shape();
+        rv *= test_space_table();
+        rv *= test_transform();
+        rv *= test_raster();
+        rv *= test_band_streaming();
+        rv *= test_binary_file();
+        rv *= test_dungeon_cache();
+        rv *= test_generation_stats();
+        rv *= test_cache_bound();
+        rv *= test_deep_generation();
+        rv *= test_rng_engines();
+        rv *= test_fixed_params();
+        rv *= test_counter_rng();
+        rv *= test_level_generation();
+        rv *= test_region_generation();
+        rv *= test_split_tree();
+        rv *= test_spatial_index();
+        rv *= test_reroll();
+        rv *= test_thread_worker();
+        rv *= test_parallel_generation();
+        rv *= test_batch_generation();
+        rv *= test_warm_generation_allocates_nothing();
         return rv;
     }
 };
 #undef TEST
 
 void printit(Dungeon& dung) {
-    auto tiles = dung.print_tiles();
-
-    for (auto& l : tiles) {
-        cout << l << "\n";
-    }
+    PackedTiles tiles;
+    dung.rasterize(tiles);
+    render_text(tiles, cout);
     cout << endl;
 }
 
 #include <sstream>
 #include <cstdlib>
-#include <chrono>
 using namespace std;
-using namespace std::chrono;
 
 Dungeon dung;
 
-template <typename F>
-auto bench(F&& f) {
-    auto start = high_resolution_clock::now();
-    f();
-    auto end = high_resolution_clock::now();
-    return (end-start);
-}
-
 int main(int argc, char* argv[]) try {
     DungeonTests tests;
 	if (tests.run_all_tests()) {
@@ -145,37 +1253,31 @@ int main(int argc, char* argv[]) try {
             stringstream(string(argv[4])) >> seed;
         }
         cout << endl << "Seed: " << seed << endl << endl;
-        duration<double,milli> mint {};
-        duration<double,milli> maxt {};
-        duration<double,milli> avg {};
-        constexpr auto loops = 10000;
-        for (int i=0; i<loops; ++i) {
-            auto t = bench([&]{dung.go(atoi(argv[1]),atoi(argv[2]));});
-            if (i==0 || t<mint) {
-                mint = t;
-            }
-            if (i==0 || t>maxt) {
-                maxt = t;
-            }
-            avg += t;
-        }
-        avg /= loops;
-        cout << "mint= " << mint.count() << endl;
-        cout << "avg=  " << avg.count() << endl;
-        cout << "maxt= " << maxt.count() << endl;
         dung.seed(seed);
         dung.go(atoi(argv[1]),atoi(argv[2]));
         printit(dung);
         if (argc >= 4) {
-            void (Dungeon::*func)(int) = &Dungeon::mult;
+            Transform xf (dung.num_cols(), dung.num_rows());
+            bool subtract = false;
             for (char c : string(argv[3])) {
                 if (c == '-') {
-                    func = &Dungeon::sub;
+                    subtract = true;
+                } else if (c == 't') {
+                    xf.transpose();
+                } else if (c == 'v') {
+                    xf.flip_rows();
+                } else if (c == 'h') {
+                    xf.flip_cols();
                 } else {
-                    (dung.*func)(c-'0');
-                    func = &Dungeon::mult;
+                    if (subtract) {
+                        xf.sub(c-'0');
+                    } else {
+                        xf.mult(c-'0');
+                    }
+                    subtract = false;
                 }
             }
+            dung.transform(xf);
         }
         printit(dung);
 	}
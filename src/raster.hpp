@@ -0,0 +1,305 @@
+#ifndef RASTER_HPP
+#define RASTER_HPP
+
+#include "space.hpp"
+#include "space_table.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #include <unistd.h>
+    #define RASTER_HAS_FD_SINK 1
+#endif
+
+// What covers a tile. Fits in two bits.
+enum class Tile : unsigned char {
+    WALL,
+    ROOM,
+    HALL_HORIZ,
+    HALL_VERT,
+};
+
+inline Tile tile_of(Dir dir) {
+    switch (dir) {
+        case Dir::HORIZ: return Tile::HALL_HORIZ;
+        case Dir::VERT: return Tile::HALL_VERT;
+        default: return Tile::ROOM;
+    }
+}
+
+// Byte written for each Tile.
+struct TilePalette {
+    unsigned char bytes[4];
+
+    unsigned char operator[](Tile t) const {
+        return bytes[int(t)];
+    }
+};
+
+constexpr TilePalette raw_palette {{0, 1, 2, 3}};
+constexpr TilePalette text_palette {{'#', '.', '-', '|'}};
+
+// The functions below take a SpaceTable, or anything with the same
+// begin_r/end_r/begin_c/end_c/dir columns and size(), like DungeonView.
+
+// Calls f(r, begin_c, end_c, tile) for every row span of every space,
+// clipped to a width by height map, in the order the spaces are stored.
+template <typename Table, typename F>
+void for_each_span(Table const& table, int width, int height, F&& f) {
+    for (std::size_t i=0, n=table.size(); i<n; ++i) {
+        int const br = std::max(table.begin_r[i], 0);
+        int const er = std::min(table.end_r[i], height);
+        int const bc = std::max(table.begin_c[i], 0);
+        int const ec = std::min(table.end_c[i], width);
+        if (bc >= ec) {
+            continue;
+        }
+        Tile const tile = tile_of(table.dir[i]);
+        for (int r=br; r<er; ++r) {
+            f(r, bc, ec, tile);
+        }
+    }
+}
+
+// Writes one byte per tile of a width by height map, row r at out + r*stride.
+template <typename Table>
+void rasterize(Table const& table, int width, int height,
+        unsigned char* out, std::size_t stride, TilePalette const& palette = raw_palette) {
+    for (int r=0; r<height; ++r) {
+        std::memset(out + r*stride, palette[Tile::WALL], width);
+    }
+    for_each_span(table, width, height, [&](int r, int bc, int ec, Tile tile){
+        std::memset(out + r*stride + bc, palette[tile], ec - bc);
+    });
+}
+
+// Tile grid packed two bits per tile, rows padded to whole words.
+// resize() keeps the storage, so one grid can be reused across maps.
+class PackedTiles {
+    using Word = std::uint64_t;
+
+    static constexpr int tiles_per_word = 32;
+    static constexpr Word pattern_one = 0x5555555555555555ull;
+
+    std::vector<Word> words;
+    int w = 0;
+    int h = 0;
+    std::size_t stride = 0;
+
+    static Word pattern(Tile t) {
+        return pattern_one * Word(t);
+    }
+
+    // Mask of the tiles [b,e) within one word, 0 <= b < e <= tiles_per_word.
+    static Word span_mask(int b, int e) {
+        Word hi = (e == tiles_per_word ? ~Word(0) : (Word(1) << (2*e)) - 1);
+        Word lo = (Word(1) << (2*b)) - 1;
+        return hi & ~lo;
+    }
+
+public:
+
+    void resize(int width, int height) {
+        w = width;
+        h = height;
+        stride = (std::size_t(width) + tiles_per_word - 1) / tiles_per_word;
+        words.resize(stride * height);
+    }
+
+    int width() const {
+        return w;
+    }
+
+    int height() const {
+        return h;
+    }
+
+    // Words per row.
+    std::size_t row_words() const {
+        return stride;
+    }
+
+    Word const* data() const {
+        return words.data();
+    }
+
+    std::size_t bytes() const {
+        return words.size() * sizeof(Word);
+    }
+
+    Tile get(int r, int c) const {
+        Word word = words[r*stride + c/tiles_per_word];
+        return Tile((word >> (2*(c%tiles_per_word))) & 3);
+    }
+
+    void clear(Tile t) {
+        std::fill(words.begin(), words.end(), pattern(t));
+    }
+
+    // Sets tiles [bc,ec) of row r.
+    void fill(int r, int bc, int ec, Tile t) {
+        Word* row = &words[r*stride];
+        Word const pat = pattern(t);
+        int bw = bc / tiles_per_word;
+        int ew = (ec - 1) / tiles_per_word;
+        int bo = bc % tiles_per_word;
+        int eo = ec - ew*tiles_per_word;
+        if (bw == ew) {
+            Word m = span_mask(bo, eo);
+            row[bw] = (row[bw] & ~m) | (pat & m);
+            return;
+        }
+        Word m = span_mask(bo, tiles_per_word);
+        row[bw] = (row[bw] & ~m) | (pat & m);
+        for (int i=bw+1; i<ew; ++i) {
+            row[i] = pat;
+        }
+        m = span_mask(0, eo);
+        row[ew] = (row[ew] & ~m) | (pat & m);
+    }
+};
+
+template <typename Table>
+void rasterize(Table const& table, int width, int height, PackedTiles& out) {
+    out.resize(width, height);
+    out.clear(Tile::WALL);
+    for_each_span(table, width, height, [&](int r, int bc, int ec, Tile tile){
+        out.fill(r, bc, ec, tile);
+    });
+}
+
+// Prints raw_palette tiles as text, one line per row.
+inline void render_text(unsigned char const* tiles, int width, int height, std::size_t stride,
+        std::ostream& out, TilePalette const& palette = text_palette) {
+    std::string line (width + 1, '\n');
+    for (int r=0; r<height; ++r) {
+        unsigned char const* row = tiles + r*stride;
+        for (int c=0; c<width; ++c) {
+            line[c] = palette[Tile(row[c])];
+        }
+        out.write(line.data(), line.size());
+    }
+}
+
+inline void render_text(PackedTiles const& tiles, std::ostream& out,
+        TilePalette const& palette = text_palette) {
+    std::string line (tiles.width() + 1, '\n');
+    for (int r=0; r<tiles.height(); ++r) {
+        for (int c=0; c<tiles.width(); ++c) {
+            line[c] = palette[tiles.get(r, c)];
+        }
+        out.write(line.data(), line.size());
+    }
+}
+
+// Rasterizes a map a band of rows at a time, so memory for tiles is bounded
+// by the band height rather than the map size. Spaces are swept in begin_r
+// order with a list of the ones active in the current band, so each band
+// only touches the spaces overlapping it. Buffers are kept between runs.
+class BandRasterizer {
+    std::vector<std::uint32_t> order;
+    std::vector<std::uint32_t> active;
+    std::vector<unsigned char> band;
+
+public:
+
+    // Calls sink(first_row, num_rows, tiles, stride) once per band, top to
+    // bottom. Rows are width tiles followed by a '\n', so stride is width+1
+    // and text palette bands can be written out as is. tiles is only valid
+    // during the call.
+    template <typename Table, typename Sink>
+    void run(Table const& table, int width, int height, int band_rows, Sink&& sink,
+            TilePalette const& palette = raw_palette) {
+        std::size_t const stride = std::size_t(width) + 1;
+        band_rows = std::max(1, std::min(band_rows, height));
+        band.resize(stride * band_rows);
+
+        order.resize(table.size());
+        for (std::size_t i=0; i<order.size(); ++i) {
+            order[i] = std::uint32_t(i);
+        }
+        std::sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b){
+            return table.begin_r[a] < table.begin_r[b];
+        });
+
+        active.clear();
+        std::size_t next = 0;
+
+        for (int first=0; first<height; first+=band_rows) {
+            int const last = std::min(first + band_rows, height);
+            int const rows = last - first;
+
+            // Drop spaces that ended above this band, then add the ones
+            // starting in it. Active spaces stay in table order so overlaps
+            // paint the same as rasterize().
+            active.erase(std::remove_if(active.begin(), active.end(), [&](std::uint32_t i){
+                return table.end_r[i] <= first;
+            }), active.end());
+            bool added = false;
+            for (; next < order.size() && table.begin_r[order[next]] < last; ++next) {
+                if (table.end_r[order[next]] > first) {
+                    active.push_back(order[next]);
+                    added = true;
+                }
+            }
+            if (added) {
+                std::sort(active.begin(), active.end());
+            }
+
+            for (int r=0; r<rows; ++r) {
+                unsigned char* row = &band[r*stride];
+                std::memset(row, palette[Tile::WALL], width);
+                row[width] = '\n';
+            }
+
+            for (std::uint32_t i : active) {
+                int const br = std::max(table.begin_r[i], first);
+                int const er = std::min(table.end_r[i], last);
+                int const bc = std::max(table.begin_c[i], 0);
+                int const ec = std::min(table.end_c[i], width);
+                if (bc >= ec) {
+                    continue;
+                }
+                unsigned char const byte = palette[tile_of(table.dir[i])];
+                for (int r=br; r<er; ++r) {
+                    std::memset(&band[(r-first)*stride + bc], byte, ec - bc);
+                }
+            }
+
+            sink(first, rows, band.data(), stride);
+        }
+    }
+};
+
+// Band sink writing whole bands to a stream. Use with text_palette.
+inline auto ostream_sink(std::ostream& out) {
+    return [&out](int, int rows, unsigned char const* tiles, std::size_t stride){
+        out.write(reinterpret_cast<char const*>(tiles), rows * stride);
+    };
+}
+
+#ifdef RASTER_HAS_FD_SINK
+// Band sink writing whole bands to a file descriptor. Use with text_palette.
+inline auto fd_sink(int fd) {
+    return [fd](int, int rows, unsigned char const* tiles, std::size_t stride){
+        std::size_t left = rows * stride;
+        while (left > 0) {
+            auto n = ::write(fd, tiles, left);
+            if (n < 0) {
+                throw std::runtime_error("fd_sink: write failed");
+            }
+            tiles += n;
+            left -= std::size_t(n);
+        }
+    };
+}
+#endif
+
+#endif // RASTER_HPP
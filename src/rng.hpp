@@ -0,0 +1,215 @@
+#ifndef RNG_HPP
+#define RNG_HPP
+
+#include <cstdint>
+#include <random>
+#include <type_traits>
+
+// Small engines for BasicDungeon, all meeting UniformRandomBitGenerator and
+// seedable from one integer like the standard engines.
+// They are a few bytes of state instead of mt19937's 2.5 KB, and seeding is
+// a handful of multiplies instead of filling that state.
+
+inline std::uint64_t splitmix64_mix(std::uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Vigna's SplitMix64. Also used to seed Xoshiro256ss.
+class SplitMix64 {
+    std::uint64_t state = 0;
+
+public:
+    using result_type = std::uint64_t;
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return ~result_type(0); }
+
+    SplitMix64() = default;
+
+    explicit SplitMix64(std::uint64_t s) {
+        seed(s);
+    }
+
+    void seed(std::uint64_t s) {
+        state = s;
+    }
+
+    result_type operator()() {
+        state += 0x9e3779b97f4a7c15ull;
+        return splitmix64_mix(state);
+    }
+};
+
+// O'Neill's PCG32 (XSH RR), 64 bits of state and a stream selector.
+class Pcg32 {
+    static constexpr std::uint64_t multiplier = 6364136223846793005ull;
+    static constexpr std::uint64_t default_stream = 0xda3e39cb94b95bdbull;
+
+    std::uint64_t state = 0;
+    std::uint64_t inc = 1;
+
+    void step() {
+        state = state * multiplier + inc;
+    }
+
+public:
+    using result_type = std::uint32_t;
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return ~result_type(0); }
+
+    Pcg32() {
+        seed(0);
+    }
+
+    explicit Pcg32(std::uint64_t s, std::uint64_t stream = default_stream) {
+        seed(s, stream);
+    }
+
+    void seed(std::uint64_t s, std::uint64_t stream = default_stream) {
+        state = 0;
+        inc = (stream << 1) | 1;
+        step();
+        state += s;
+        step();
+    }
+
+    result_type operator()() {
+        auto old = state;
+        step();
+        auto xorshifted = std::uint32_t(((old >> 18) ^ old) >> 27);
+        auto rot = std::uint32_t(old >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+    }
+};
+
+// Blackman and Vigna's xoshiro256**.
+class Xoshiro256ss {
+    std::uint64_t s[4];
+
+    static std::uint64_t rotl(std::uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+
+public:
+    using result_type = std::uint64_t;
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return ~result_type(0); }
+
+    Xoshiro256ss() {
+        seed(0);
+    }
+
+    explicit Xoshiro256ss(std::uint64_t v) {
+        seed(v);
+    }
+
+    // Expands the seed with SplitMix64, which never gives the all zero state.
+    void seed(std::uint64_t v) {
+        SplitMix64 sm (v);
+        for (auto& w : s) {
+            w = sm();
+        }
+    }
+
+    result_type operator()() {
+        auto const rv = rotl(s[1] * 5, 7) * 9;
+        auto const t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return rv;
+    }
+};
+
+// Stateless randomness for counter mode. Every draw is a hash of where it is
+// made, so it doesn't depend on any draw before it.
+
+// Mixes a seed, a node of the split tree and the draw's slot at that node
+// into the key of a CounterStream.
+inline std::uint64_t counter_key(std::uint64_t seed, std::uint64_t node, std::uint32_t slot) {
+    auto h = splitmix64_mix(seed + 0x9e3779b97f4a7c15ull);
+    h = splitmix64_mix(h ^ (node * 0xd1342543de82ef95ull));
+    return splitmix64_mix(h ^ (std::uint64_t(slot) * 0xaf251af3b0f025b5ull + 1));
+}
+
+// Outputs for one key, the i-th being a hash of (key, i). Usually only the
+// first is used; bounded_rand() takes more on a rejection.
+class CounterStream {
+    std::uint64_t key;
+    std::uint64_t i = 0;
+
+public:
+    using result_type = std::uint64_t;
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return ~result_type(0); }
+
+    explicit CounterStream(std::uint64_t key) : key(key) {}
+
+    result_type operator()() {
+        return splitmix64_mix(key + (++i) * 0x9e3779b97f4a7c15ull);
+    }
+};
+
+// Whether uniform_int() uses bounded_rand() for an engine.
+// Only engines known to give full range 32 or 64 bit outputs opt in; the
+// standard ones keep uniform_int_distribution, so their dungeons for a
+// given seed stay the same.
+template <typename Engine>
+struct UsesBoundedRand : std::false_type {};
+
+template <> struct UsesBoundedRand<SplitMix64> : std::true_type {};
+template <> struct UsesBoundedRand<Pcg32> : std::true_type {};
+template <> struct UsesBoundedRand<Xoshiro256ss> : std::true_type {};
+template <> struct UsesBoundedRand<CounterStream> : std::true_type {};
+
+// Top 32 bits of one output, the better ones for the LCG and xoshiro.
+template <typename Engine>
+std::uint32_t random_bits32(Engine& eng) {
+    static_assert(Engine::min() == 0, "Engine must give full range outputs");
+    static_assert(
+        Engine::max() == 0xffffffffull || Engine::max() == ~0ull,
+        "Engine must give 32 or 64 bit outputs");
+    auto const x = std::uint64_t(eng());
+    return std::uint32_t(Engine::max() == 0xffffffffull ? x : x >> 32);
+}
+
+// Unbiased integer in [0, range), range > 0, by Lemire's multiply and
+// reject. Takes a single draw and no division, except on the rare rejection.
+template <typename Engine>
+std::uint32_t bounded_rand(Engine& eng, std::uint32_t range) {
+    auto m = std::uint64_t(random_bits32(eng)) * range;
+    auto l = std::uint32_t(m);
+    if (l < range) {
+        auto const t = std::uint32_t(-range) % range;
+        while (l < t) {
+            m = std::uint64_t(random_bits32(eng)) * range;
+            l = std::uint32_t(m);
+        }
+    }
+    return std::uint32_t(m >> 32);
+}
+
+// Uniform integer in [a, b].
+template <typename Engine>
+std::enable_if_t<UsesBoundedRand<Engine>::value, int> uniform_int(Engine& eng, int a, int b) {
+    auto const range = std::uint32_t(std::int64_t(b) - a + 1);
+    if (range == 0) {
+        return int(std::int64_t(a) + random_bits32(eng));
+    }
+    return int(std::int64_t(a) + bounded_rand(eng, range));
+}
+
+template <typename Engine>
+std::enable_if_t<!UsesBoundedRand<Engine>::value, int> uniform_int(Engine& eng, int a, int b) {
+    return std::uniform_int_distribution<int>(a, b)(eng);
+}
+
+#endif // RNG_HPP
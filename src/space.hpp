@@ -3,11 +3,11 @@
 
 #include "ranges.hpp"
 
+#include <cstdint>
 #include <iostream>
 #include <stdexcept>
 #include <tuple>
 #include <utility>
-#include <vector>
 
 // Directions
 // Horizontal hall - hall going East-West
@@ -119,6 +119,58 @@ struct Rect {
         }
     }
 
+    // The accessors above with the direction fixed at compile time, for
+    // code that picks the direction once and loops. Each is a plain member
+    // access, with nothing to check or throw.
+
+    template <Dir D>
+    int& begin_longitude() {
+        Rect const& self = *this;
+        return const_cast<int&>(self.begin_longitude<D>());
+    }
+
+    template <Dir D>
+    int& end_longitude() {
+        Rect const& self = *this;
+        return const_cast<int&>(self.end_longitude<D>());
+    }
+
+    template <Dir D>
+    int& begin_latitude() {
+        Rect const& self = *this;
+        return const_cast<int&>(self.begin_latitude<D>());
+    }
+
+    template <Dir D>
+    int& end_latitude() {
+        Rect const& self = *this;
+        return const_cast<int&>(self.end_latitude<D>());
+    }
+
+    template <Dir D>
+    int const& begin_longitude() const {
+        static_assert(D != Dir::NONE, "Must be valid direction!");
+        return (D == Dir::HORIZ ? begin_c : begin_r);
+    }
+
+    template <Dir D>
+    int const& end_longitude() const {
+        static_assert(D != Dir::NONE, "Must be valid direction!");
+        return (D == Dir::HORIZ ? end_c : end_r);
+    }
+
+    template <Dir D>
+    int const& begin_latitude() const {
+        static_assert(D != Dir::NONE, "Must be valid direction!");
+        return (D == Dir::HORIZ ? begin_r : begin_c);
+    }
+
+    template <Dir D>
+    int const& end_latitude() const {
+        static_assert(D != Dir::NONE, "Must be valid direction!");
+        return (D == Dir::HORIZ ? end_r : end_c);
+    }
+
     auto range_longitude(Dir dir) const {
         return number_range(begin_longitude(dir),end_longitude(dir));
     }
@@ -135,6 +187,26 @@ struct Rect {
         return (end_latitude(dir)-begin_latitude(dir));
     }
 
+    template <Dir D>
+    auto range_longitude() const {
+        return number_range(begin_longitude<D>(),end_longitude<D>());
+    }
+
+    template <Dir D>
+    auto range_latitude() const {
+        return number_range(begin_latitude<D>(),end_latitude<D>());
+    }
+
+    template <Dir D>
+    int len_longitude() const {
+        return (end_longitude<D>()-begin_longitude<D>());
+    }
+
+    template <Dir D>
+    int len_latitude() const {
+        return (end_latitude<D>()-begin_latitude<D>());
+    }
+
     std::pair<Rect,Rect> split(Dir dir, int pos) const {
         std::pair<Rect,Rect> rv (*this,*this);
         rv.first.end_longitude(dir) = pos;
@@ -142,6 +214,14 @@ struct Rect {
         return rv;
     }
 
+    template <Dir D>
+    std::pair<Rect,Rect> split(int pos) const {
+        std::pair<Rect,Rect> rv (*this,*this);
+        rv.first.end_longitude<D>() = pos;
+        rv.second.begin_longitude<D>() = pos;
+        return rv;
+    }
+
     bool contains(Rect const& other) const {
         return (
             begin_r <= other.begin_r &&
@@ -149,6 +229,19 @@ struct Rect {
             begin_c <= other.begin_c &&
             end_c >= other.end_c);
     }
+
+    // Whether the rects share a tile, so empty rects intersect nothing.
+    bool intersects(Rect const& other) const {
+        return (
+            begin_r < end_r &&
+            begin_c < end_c &&
+            other.begin_r < other.end_r &&
+            other.begin_c < other.end_c &&
+            begin_r < other.end_r &&
+            other.begin_r < end_r &&
+            begin_c < other.end_c &&
+            other.begin_c < end_c);
+    }
 };
 
 inline bool operator==(Rect const& a, Rect const& b) {
@@ -193,14 +286,22 @@ struct Space {
         HallData hall;
         SpaceData() : nd{} {}
     } data;
+};
 
-    std::vector<Space*> neighbors;
+// Index of a Space in its Dungeon.
+using SpaceId = std::uint32_t;
 
-    Space() {
-        neighbors.reserve(5);
-    }
-};
+template <Dir D>
+Rect get_hall_shape(HallData const& hall) {
+    Rect rv;
+    rv.begin_longitude<D>() = hall.begin;
+    rv.end_longitude<D>() = hall.end;
+    rv.begin_latitude<D>() = hall.dir_loc;
+    rv.end_latitude<D>() = hall.dir_loc+hall.thickness;
+    return rv;
+}
 
+// Switches on the hall's direction once, rather than per coordinate.
 inline Rect get_shape(Space const& sp) {
     Rect rv;
 
@@ -210,11 +311,17 @@ inline Rect get_shape(Space const& sp) {
         } break;
 
         case SpaceType::HALL: {
-            Dir dir = sp.data.hall.dir;
-            rv.begin_longitude(dir) = sp.data.hall.begin;
-            rv.end_longitude(dir) = sp.data.hall.end;
-            rv.begin_latitude(dir) = sp.data.hall.dir_loc;
-            rv.end_latitude(dir) = sp.data.hall.dir_loc+sp.data.hall.thickness;
+            switch (sp.data.hall.dir) {
+                case Dir::HORIZ: {
+                    rv = get_hall_shape<Dir::HORIZ>(sp.data.hall);
+                } break;
+                case Dir::VERT: {
+                    rv = get_hall_shape<Dir::VERT>(sp.data.hall);
+                } break;
+                default: {
+                    throw std::logic_error("Must be valid direction!");
+                } break;
+            }
         } break;
 
         default: {
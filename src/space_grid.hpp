@@ -0,0 +1,216 @@
+#ifndef SPACE_GRID_HPP
+#define SPACE_GRID_HPP
+
+#include "space.hpp"
+#include "arena.hpp"
+#include "array_view.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+// Uniform grid over a map's spaces, for range queries.
+// Cells are 2^shift tiles a side, in row-major order, and list every space
+// overlapping them in one flat array: cell i's spaces are
+// items[cell_offsets[i]] up to items[cell_offsets[i+1]].
+// Queries report a space only from the first of its cells under the query,
+// so they need no scratch memory to skip duplicates.
+// Tiles off the grid belong to its nearest edge cell, so spaces moved past
+// the map's edges, as by a translate, are still indexed.
+// Tables are anything with rect(i), like SpaceTable or DungeonView.
+struct SpaceGridView {
+    static constexpr SpaceId no_space = SpaceId(-1);
+
+    int shift = 0;
+    int rows = 0;  // In cells.
+    int cols = 0;
+    ArrayView<std::uint32_t const> cell_offsets;
+    ArrayView<SpaceId const> items;
+
+    bool empty() const {
+        return rows == 0 || cols == 0;
+    }
+
+    // Cell row and column of a tile, clamped to the grid.
+    int cell_r(int r) const {
+        return std::min(std::max(r, 0) >> shift, rows - 1);
+    }
+
+    int cell_c(int c) const {
+        return std::min(std::max(c, 0) >> shift, cols - 1);
+    }
+
+    // Calls sink(id) once for every space intersecting rect.
+    template <typename Table, typename Sink>
+    void query(Table const& table, Rect const& rect, Sink&& sink) const {
+        if (empty() || rect.begin_r >= rect.end_r || rect.begin_c >= rect.end_c) {
+            return;
+        }
+
+        int const r0 = cell_r(rect.begin_r);
+        int const c0 = cell_c(rect.begin_c);
+        int const r1 = cell_r(rect.end_r - 1);
+        int const c1 = cell_c(rect.end_c - 1);
+
+        for (int cy=r0; cy<=r1; ++cy) {
+            for (int cx=c0; cx<=c1; ++cx) {
+                auto const cell = std::size_t(cy) * cols + cx;
+                for (auto i=cell_offsets[cell]; i<cell_offsets[cell+1]; ++i) {
+                    SpaceId const id = items[i];
+                    Rect const sr = table.rect(id);
+                    if (!sr.intersects(rect)) {
+                        continue;
+                    }
+                    if (cell_r(std::max(sr.begin_r, rect.begin_r)) == cy &&
+                        cell_c(std::max(sr.begin_c, rect.begin_c)) == cx) {
+                        sink(id);
+                    }
+                }
+            }
+        }
+    }
+
+    // Space covering the tile at (r,c), or no_space.
+    template <typename Table>
+    SpaceId locate(Table const& table, int r, int c) const {
+        if (empty()) {
+            return no_space;
+        }
+        auto const cell = std::size_t(cell_r(r)) * cols + cell_c(c);
+        for (auto i=cell_offsets[cell]; i<cell_offsets[cell+1]; ++i) {
+            if (table.rect(items[i]).contains(Rect{r, r+1, c, c+1})) {
+                return items[i];
+            }
+        }
+        return no_space;
+    }
+
+    // Walks the tiles of a line from (r0,c0) to (r1,c1), calling sink(id)
+    // whenever it enters another space. Returns false if a wall blocks it.
+    template <typename Table, typename Sink>
+    bool trace(Table const& table, int r0, int c0, int r1, int c1, Sink&& sink) const {
+        int const dr = std::abs(r1 - r0);
+        int const dc = std::abs(c1 - c0);
+        int const sr = (r0 < r1 ? 1 : -1);
+        int const sc = (c0 < c1 ? 1 : -1);
+        int err = dc - dr;
+        SpaceId last = no_space;
+        while (true) {
+            auto id = locate(table, r0, c0);
+            if (id == no_space) {
+                return false;
+            }
+            if (id != last) {
+                sink(id);
+                last = id;
+            }
+            if (r0 == r1 && c0 == c1) {
+                return true;
+            }
+            int const e2 = err * 2;
+            if (e2 > -dr) {
+                err -= dr;
+                c0 += sc;
+            }
+            if (e2 < dc) {
+                err += dc;
+                r0 += sr;
+            }
+        }
+    }
+};
+
+// Owner of a SpaceGridView's arrays.
+// Buffers only ever grow, so rebuilding for a similar map doesn't allocate.
+class SpaceGrid {
+    int shift = 0;
+    int rows = 0;
+    int cols = 0;
+    CountedVector<std::uint32_t> cell_offsets;
+    CountedVector<SpaceId> items;
+
+public:
+
+    SpaceGrid() = default;
+
+    explicit SpaceGrid(AllocCounter* counter)
+        : cell_offsets(CountingAllocator<std::uint32_t>(counter))
+        , items(CountingAllocator<SpaceId>(counter)) {}
+
+    // Rebuilds the grid for a w by h map.
+    // Cells are sized to hold a couple of spaces each on average.
+    template <typename Table>
+    void build(Table const& table, int w, int h) {
+        auto const n = table.size();
+
+        shift = 2;
+        while (shift < 16 && (std::size_t(1) << (shift*2 + 2)) * n <= std::size_t(w) * h * 2) {
+            ++shift;
+        }
+        rows = (std::max(h, 1) + (1 << shift) - 1) >> shift;
+        cols = (std::max(w, 1) + (1 << shift) - 1) >> shift;
+
+        auto const cells = std::size_t(rows) * cols;
+        cell_offsets.assign(cells + 1, 0);
+
+        auto const v = view();
+        auto each_cell = [&](Rect const& sr, auto&& f){
+            int const r0 = v.cell_r(sr.begin_r);
+            int const c0 = v.cell_c(sr.begin_c);
+            int const r1 = v.cell_r(sr.end_r - 1);
+            int const c1 = v.cell_c(sr.end_c - 1);
+            for (int cy=r0; cy<=r1; ++cy) {
+                for (int cx=c0; cx<=c1; ++cx) {
+                    f(std::size_t(cy) * cols + cx);
+                }
+            }
+        };
+
+        // Count into the cell's own slot, turn the counts into starts, then
+        // fill with the starts as cursors, which leaves each at its cell's end.
+        for (std::size_t i=0; i<n; ++i) {
+            each_cell(table.rect(i), [&](std::size_t cell){
+                ++cell_offsets[cell];
+            });
+        }
+        std::uint32_t sum = 0;
+        for (std::size_t cell=0; cell<cells; ++cell) {
+            auto const count = cell_offsets[cell];
+            cell_offsets[cell] = sum;
+            sum += count;
+        }
+        cell_offsets[cells] = sum;
+
+        items.resize(sum);
+        for (std::size_t i=0; i<n; ++i) {
+            each_cell(table.rect(i), [&](std::size_t cell){
+                items[cell_offsets[cell]++] = SpaceId(i);
+            });
+        }
+        for (std::size_t cell=cells; cell>0; --cell) {
+            cell_offsets[cell] = cell_offsets[cell-1];
+        }
+        cell_offsets[0] = 0;
+    }
+
+    void clear() {
+        shift = 0;
+        rows = 0;
+        cols = 0;
+        cell_offsets.clear();
+        items.clear();
+    }
+
+    SpaceGridView view() const {
+        SpaceGridView rv;
+        rv.shift = shift;
+        rv.rows = rows;
+        rv.cols = cols;
+        rv.cell_offsets = ArrayView<std::uint32_t const>(cell_offsets.data(), cell_offsets.data() + cell_offsets.size());
+        rv.items = ArrayView<SpaceId const>(items.data(), items.data() + items.size());
+        return rv;
+    }
+};
+
+#endif // SPACE_GRID_HPP
@@ -0,0 +1,126 @@
+#ifndef SPACE_TABLE_HPP
+#define SPACE_TABLE_HPP
+
+#include "space.hpp"
+#include "arena.hpp"
+
+#include <cstddef>
+
+// Struct-of-arrays copy of a dungeon's spaces.
+// Halls are stored as the rects they cover, so every space is just four
+// coordinates, and passes over all spaces are loops over contiguous ints.
+// Whole-map transforms live in transform.hpp.
+struct SpaceTable {
+    using IntVec = CountedVector<int>;
+    using DirVec = CountedVector<Dir>;
+
+    IntVec begin_r;
+    IntVec end_r;
+    IntVec begin_c;
+    IntVec end_c;
+
+    // Dir::NONE for rooms, the hall direction for halls.
+    DirVec dir;
+
+    SpaceTable() = default;
+
+    explicit SpaceTable(AllocCounter* counter)
+        : begin_r(CountingAllocator<int>(counter))
+        , end_r(CountingAllocator<int>(counter))
+        , begin_c(CountingAllocator<int>(counter))
+        , end_c(CountingAllocator<int>(counter))
+        , dir(CountingAllocator<Dir>(counter)) {}
+
+    std::size_t size() const {
+        return dir.size();
+    }
+
+    void reserve(std::size_t n) {
+        begin_r.reserve(n);
+        end_r.reserve(n);
+        begin_c.reserve(n);
+        end_c.reserve(n);
+        dir.reserve(n);
+    }
+
+    SpaceType type(std::size_t i) const {
+        return (dir[i] == Dir::NONE ? SpaceType::ROOM : SpaceType::HALL);
+    }
+
+    Rect rect(std::size_t i) const {
+        return Rect{begin_r[i], end_r[i], begin_c[i], end_c[i]};
+    }
+
+    // Copies the shapes of spaces, from index from on if the ones before it
+    // are already here.
+    template <typename Spaces>
+    void assign(Spaces const& spaces, std::size_t from = 0) {
+        auto n = spaces.size();
+        begin_r.resize(n);
+        end_r.resize(n);
+        begin_c.resize(n);
+        end_c.resize(n);
+        dir.resize(n);
+
+        for (std::size_t i=from; i<n; ++i) {
+            Space const& sp = spaces[i];
+            auto shape = get_shape(sp);
+            begin_r[i] = shape.begin_r;
+            end_r[i] = shape.end_r;
+            begin_c[i] = shape.begin_c;
+            end_c[i] = shape.end_c;
+            dir[i] = (sp.type == SpaceType::HALL ? sp.data.hall.dir : Dir::NONE);
+        }
+    }
+
+    // Writes the shapes back into spaces, which must be the ones assigned from.
+    template <typename Spaces>
+    void store(Spaces& spaces) const {
+        std::size_t i = 0;
+        for (Space& sp : spaces) {
+            auto shape = rect(i);
+            if (dir[i] == Dir::NONE) {
+                sp.data.room = shape;
+            } else {
+                auto& hall = sp.data.hall;
+                hall.dir = dir[i];
+                hall.dir_loc = shape.begin_latitude(hall.dir);
+                hall.thickness = shape.len_latitude(hall.dir);
+                hall.begin = shape.begin_longitude(hall.dir);
+                hall.end = shape.end_longitude(hall.dir);
+            }
+            ++i;
+        }
+    }
+
+    // Index of the first space containing tile (r,c), or -1.
+    long find(int r, int c) const {
+        int const* br = begin_r.data();
+        int const* er = end_r.data();
+        int const* bc = begin_c.data();
+        int const* ec = end_c.data();
+        for (std::size_t i=0, n=size(); i<n; ++i) {
+            if ((br[i] <= r) & (r < er[i]) & (bc[i] <= c) & (c < ec[i])) {
+                return long(i);
+            }
+        }
+        return -1;
+    }
+
+    // Calls f(index) for every space overlapping rect.
+    template <typename F>
+    void for_each_overlapping(Rect const& rect, F&& f) const {
+        int const* br = begin_r.data();
+        int const* er = end_r.data();
+        int const* bc = begin_c.data();
+        int const* ec = end_c.data();
+        for (std::size_t i=0, n=size(); i<n; ++i) {
+            if ((br[i] < rect.end_r) & (rect.begin_r < er[i]) &
+                (bc[i] < rect.end_c) & (rect.begin_c < ec[i])) {
+                f(i);
+            }
+        }
+    }
+};
+
+#endif // SPACE_TABLE_HPP
@@ -1,100 +1,530 @@
 #ifndef THREAD_WORKER_HPP
 #define THREAD_WORKER_HPP
 
+#include <algorithm>
 #include <thread>
-#include <future>
 #include <mutex>
 #include <condition_variable>
-#include <list>
+#include <atomic>
 #include <utility>
-#include <functional>
+#include <tuple>
 #include <exception>
 #include <vector>
 #include <memory>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
 
+// Work-stealing thread pool.
+// Every worker owns a lock-free deque; tasks submitted from a worker go to
+// its own deque, tasks from other threads go to a shared injection queue,
+// and a worker that runs dry steals from the others.
+// Tasks and their results live in a fixed pool of slots, so submitting a
+// task whose callable fits in a slot does not allocate.
 template <typename Data>
 struct ThreadWorker {
-    using Task = std::pair<std::function<Data()>,std::promise<Data>>;
+    static constexpr std::size_t small_size = 64;
+    static constexpr std::size_t slot_count = 1024;
+    static constexpr std::size_t deque_size = 1024;
 
-    struct Worker {
-        std::thread t;
-
-        struct MTCV {
-            std::mutex mt;
-            std::condition_variable cv;
+    struct Slot {
+        enum State {
+            FREE,
+            PENDING,
+            DONE,
         };
 
-        std::unique_ptr<MTCV> mtcv = std::make_unique<MTCV>();
+        using Invoke = void(*)(Slot&);
+        using Destroy = void(*)(Slot&);
+
+        alignas(std::max_align_t) unsigned char storage[small_size];
+        alignas(Data) unsigned char result[sizeof(Data)];
+        std::exception_ptr error;
+
+        Invoke invoke = nullptr;
+        Destroy destroy = nullptr;
+
+        std::atomic<int> state {FREE};
+        std::atomic<std::uint32_t> next_free {0};
+        bool pooled = true;
+
+        Data& get_result() {
+            return *reinterpret_cast<Data*>(result);
+        }
+
+        template <typename F>
+        void emplace(F&& f) {
+            using Fn = std::decay_t<F>;
+            constexpr bool fits = (
+                sizeof(Fn) <= small_size &&
+                alignof(Fn) <= alignof(std::max_align_t));
+            emplace_impl<Fn>(std::forward<F>(f), std::integral_constant<bool,fits>{});
+        }
+
+        void run() {
+            try {
+                invoke(*this);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            destroy(*this);
+        }
+
+    private:
+
+        template <typename Fn, typename F>
+        void emplace_impl(F&& f, std::true_type) {
+            new (storage) Fn(std::forward<F>(f));
+            invoke = [](Slot& s){
+                auto& fn = *reinterpret_cast<Fn*>(s.storage);
+                new (s.result) Data(fn());
+            };
+            destroy = [](Slot& s){
+                reinterpret_cast<Fn*>(s.storage)->~Fn();
+            };
+        }
+
+        // Callables that don't fit are kept on the heap.
+        template <typename Fn, typename F>
+        void emplace_impl(F&& f, std::false_type) {
+            new (storage) Fn*(new Fn(std::forward<F>(f)));
+            invoke = [](Slot& s){
+                auto& fn = **reinterpret_cast<Fn**>(s.storage);
+                new (s.result) Data(fn());
+            };
+            destroy = [](Slot& s){
+                delete *reinterpret_cast<Fn**>(s.storage);
+            };
+        }
+    };
+
+    // Chase-Lev deque of fixed capacity.
+    // Only the owner pushes and pops at the bottom; anyone can steal from the top.
+    class Deque {
+        std::atomic<std::int64_t> top {0};
+        std::atomic<std::int64_t> bottom {0};
+        std::atomic<Slot*> buf[deque_size];
 
-        bool die = false;
-        std::list<Task> tasks;
+    public:
 
-        Worker() {
-            t = std::thread(&Worker::loop, this);
+        Deque() {
+            for (auto& s : buf) {
+                s.store(nullptr, std::memory_order_relaxed);
+            }
         }
 
-        void loop() {
-            std::unique_lock<std::mutex> lk (mtcv->mt);
-            while (true) {
-                while (tasks.empty() && !die)
-                    mtcv->cv.wait(lk);
+        bool push(Slot* s) {
+            auto b = bottom.load(std::memory_order_relaxed);
+            auto t = top.load(std::memory_order_acquire);
+            if (b - t >= std::int64_t(deque_size)) {
+                return false;
+            }
+            buf[b % deque_size].store(s, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return true;
+        }
+
+        Slot* pop() {
+            auto b = bottom.load(std::memory_order_relaxed) - 1;
+            bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            auto t = top.load(std::memory_order_relaxed);
+
+            if (t > b) {
+                bottom.store(b + 1, std::memory_order_relaxed);
+                return nullptr;
+            }
 
-                while (!tasks.empty()) {
-                    auto task = std::move(tasks.front());
-                    tasks.erase(tasks.begin());
-                    lk.unlock();
-                    try {
-                        task.second.set_value(task.first());
-                    } catch (...) {
-                        task.second.set_exception(std::current_exception());
-                    }
-                    lk.lock();
+            Slot* rv = buf[b % deque_size].load(std::memory_order_relaxed);
+            if (t == b) {
+                // Last task, race the thieves for it.
+                if (!top.compare_exchange_strong(t, t + 1,
+                        std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                    rv = nullptr;
                 }
+                bottom.store(b + 1, std::memory_order_relaxed);
+            }
+            return rv;
+        }
 
-                if (die) {
-                    return;
+        Slot* steal() {
+            auto t = top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            auto b = bottom.load(std::memory_order_acquire);
+
+            if (t >= b) {
+                return nullptr;
+            }
+
+            Slot* rv = buf[t % deque_size].load(std::memory_order_relaxed);
+            if (!top.compare_exchange_strong(t, t + 1,
+                    std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                return nullptr;
+            }
+            return rv;
+        }
+    };
+
+    // Result of do_task().
+    // Waiting on it runs other queued tasks instead of blocking, so tasks
+    // may safely wait on tasks they submitted.
+    class Future {
+        ThreadWorker* pool = nullptr;
+        Slot* slot = nullptr;
+
+        friend struct ThreadWorker;
+
+        Future(ThreadWorker* pool, Slot* slot) : pool(pool), slot(slot) {}
+
+        void reset() {
+            if (slot) {
+                wait();
+                if (slot->error) {
+                    slot->error = nullptr;
+                } else {
+                    slot->get_result().~Data();
                 }
+                pool->release(slot);
+                slot = nullptr;
             }
         }
+
+    public:
+
+        Future() = default;
+
+        Future(Future&& other) : pool(other.pool), slot(other.slot) {
+            other.slot = nullptr;
+        }
+
+        Future& operator=(Future&& other) {
+            if (this != &other) {
+                reset();
+                pool = other.pool;
+                slot = other.slot;
+                other.slot = nullptr;
+            }
+            return *this;
+        }
+
+        ~Future() {
+            reset();
+        }
+
+        bool valid() const {
+            return (slot != nullptr);
+        }
+
+        bool ready() const {
+            return (slot->state.load(std::memory_order_acquire) == Slot::DONE);
+        }
+
+        void wait() {
+            pool->wait_for(*slot);
+        }
+
+        Data get() {
+            wait();
+            if (slot->error) {
+                auto e = std::move(slot->error);
+                slot->error = nullptr;
+                pool->release(slot);
+                slot = nullptr;
+                std::rethrow_exception(e);
+            }
+            Data rv = std::move(slot->get_result());
+            slot->get_result().~Data();
+            pool->release(slot);
+            slot = nullptr;
+            return rv;
+        }
     };
 
-    std::vector<Worker> workers;
+private:
+
+    template <typename Func, typename... Ts>
+    struct BoundTask {
+        Func func;
+        std::tuple<Ts...> args;
 
-    ThreadWorker() {
-        workers.resize(std::min(std::thread::hardware_concurrency(),1u));
+        Data operator()() {
+            return call(std::index_sequence_for<Ts...>{});
+        }
+
+        template <std::size_t... Is>
+        Data call(std::index_sequence<Is...>) {
+            return std::move(func)(std::move(std::get<Is>(args))...);
+        }
+    };
+
+    struct Worker {
+        Deque tasks;
+    };
+
+    std::unique_ptr<Worker[]> workers;
+    std::vector<std::thread> threads;
+    unsigned num_workers = 0;
+
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<std::uint64_t> free_head {0};
+
+    // Tasks submitted from threads outside the pool.
+    std::mutex inject_mt;
+    Slot* inject[deque_size];
+    std::size_t inject_begin = 0;
+    std::size_t inject_size = 0;
+
+    std::atomic<int> pending {0};
+    std::atomic<int> sleepers {0};
+    std::atomic<int> waiters {0};
+    std::atomic<bool> die {false};
+
+    std::mutex sleep_mt;
+    std::condition_variable sleep_cv;
+    std::mutex done_mt;
+    std::condition_variable done_cv;
+
+    struct Current {
+        ThreadWorker* pool;
+        unsigned index;
+    };
+
+    static Current& current() {
+        static thread_local Current cur {nullptr, 0};
+        return cur;
     }
 
-    ~ThreadWorker() {
-        for (auto& w : workers) {
+    Slot* acquire() {
+        auto h = free_head.load(std::memory_order_acquire);
+        while (std::uint32_t idx = std::uint32_t(h)) {
+            auto next = slots[idx-1].next_free.load(std::memory_order_relaxed);
+            auto nh = (((h >> 32) + 1) << 32) | next;
+            if (free_head.compare_exchange_weak(h, nh,
+                    std::memory_order_acquire, std::memory_order_acquire)) {
+                return &slots[idx-1];
+            }
+        }
+        // Pool is exhausted, fall back to the heap.
+        auto rv = new Slot;
+        rv->pooled = false;
+        return rv;
+    }
+
+    void release(Slot* s) {
+        if (!s->pooled) {
+            delete s;
+            return;
+        }
+        s->state.store(Slot::FREE, std::memory_order_relaxed);
+        std::uint64_t idx = (s - &slots[0]) + 1;
+        auto h = free_head.load(std::memory_order_relaxed);
+        do {
+            s->next_free.store(std::uint32_t(h), std::memory_order_relaxed);
+        } while (!free_head.compare_exchange_weak(h, (((h >> 32) + 1) << 32) | idx,
+                std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    bool push_inject(Slot* s) {
+        std::unique_lock<std::mutex> lk (inject_mt);
+        if (inject_size == deque_size) {
+            return false;
+        }
+        inject[(inject_begin + inject_size) % deque_size] = s;
+        ++inject_size;
+        return true;
+    }
+
+    Slot* pop_inject() {
+        std::unique_lock<std::mutex> lk (inject_mt);
+        if (inject_size == 0) {
+            return nullptr;
+        }
+        Slot* rv = inject[inject_begin];
+        inject_begin = (inject_begin + 1) % deque_size;
+        --inject_size;
+        return rv;
+    }
+
+    Slot* find_task() {
+        auto& cur = current();
+        bool const is_worker = (cur.pool == this);
+        unsigned const self = (is_worker ? cur.index : 0);
+
+        if (is_worker) {
+            if (Slot* s = workers[self].tasks.pop()) {
+                return s;
+            }
+        }
+
+        if (pending.load() == 0) {
+            return nullptr;
+        }
+
+        if (Slot* s = pop_inject()) {
+            return s;
+        }
+
+        for (unsigned i=1; i<=num_workers; ++i) {
+            unsigned victim = (self + i) % num_workers;
+            if (is_worker && victim == self) {
+                continue;
+            }
+            if (Slot* s = workers[victim].tasks.steal()) {
+                return s;
+            }
+        }
+
+        return nullptr;
+    }
+
+    void execute(Slot* s) {
+        pending.fetch_sub(1);
+        s->run();
+        s->state.store(Slot::DONE);
+        if (waiters.load() > 0) {
+            std::unique_lock<std::mutex> lk (done_mt);
+            done_cv.notify_all();
+        }
+    }
+
+    bool run_one() {
+        if (Slot* s = find_task()) {
+            execute(s);
+            return true;
+        }
+        return false;
+    }
+
+    void wait_for(Slot& s) {
+        constexpr int spins = 64;
+        int idle = 0;
+        while (s.state.load(std::memory_order_acquire) != Slot::DONE) {
+            if (run_one()) {
+                idle = 0;
+                continue;
+            }
+            if (++idle < spins) {
+                std::this_thread::yield();
+                continue;
+            }
+            // Nothing to help with, sleep until some task finishes.
+            waiters.fetch_add(1);
             {
-                std::unique_lock<std::mutex> lk (w.mtcv->mt);
-                w.die = true;
+                std::unique_lock<std::mutex> lk (done_mt);
+                while (s.state.load() != Slot::DONE && pending.load() == 0) {
+                    done_cv.wait(lk);
+                }
             }
-            w.mtcv->cv.notify_one();
-            w.t.join();
+            waiters.fetch_sub(1);
+            idle = 0;
         }
     }
 
-    template <typename Func, typename... Ts>
-    std::future<Data> do_task(Func&& f, Ts&&... ts) {
-        auto iter = min_element(begin(workers),end(workers),[](auto& w1, auto& w2){
-            std::unique_lock<std::mutex> lk1 (w1.mtcv->mt, std::defer_lock);
-            std::unique_lock<std::mutex> lk2 (w2.mtcv->mt, std::defer_lock);
-            std::lock(lk1,lk2);
-            return w1.tasks.size()<w2.tasks.size();
-        });
-        std::list<Task> tmp;
-        // TODO: Perfect forwarding?
-        auto func = [=]{ return std::move(f)(std::move(ts)...); };
-        auto task = std::make_pair(std::move(func), std::promise<Data>{});
-        auto rv = task.second.get_future();
-        tmp.push_back(std::move(task));
+    void loop(unsigned index) {
+        current() = Current{this, index};
+
+        constexpr int spins = 64;
+        int idle = 0;
+        while (true) {
+            if (run_one()) {
+                idle = 0;
+                continue;
+            }
+            if (++idle < spins) {
+                std::this_thread::yield();
+                continue;
+            }
+            sleepers.fetch_add(1);
+            {
+                std::unique_lock<std::mutex> lk (sleep_mt);
+                while (pending.load() == 0 && !die.load()) {
+                    sleep_cv.wait(lk);
+                }
+            }
+            sleepers.fetch_sub(1);
+            idle = 0;
+            if (die.load() && pending.load() == 0) {
+                return;
+            }
+        }
+    }
+
+    void notify() {
+        if (sleepers.load() > 0) {
+            std::unique_lock<std::mutex> lk (sleep_mt);
+            sleep_cv.notify_one();
+        }
+        if (waiters.load() > 0) {
+            std::unique_lock<std::mutex> lk (done_mt);
+            done_cv.notify_all();
+        }
+    }
+
+public:
+
+    // A num_threads of 0 uses one thread per hardware thread.
+    explicit ThreadWorker(unsigned num_threads = 0) {
+        if (num_threads == 0) {
+            num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+        }
+
+        slots = std::make_unique<Slot[]>(slot_count);
+        for (std::size_t i=0; i<slot_count; ++i) {
+            slots[i].next_free.store(std::uint32_t(i + 1 < slot_count ? i + 2 : 0));
+        }
+        free_head.store(1);
+
+        num_workers = num_threads;
+        workers = std::make_unique<Worker[]>(num_workers);
+        threads.reserve(num_workers);
+        for (unsigned i=0; i<num_workers; ++i) {
+            threads.emplace_back(&ThreadWorker::loop, this, i);
+        }
+    }
+
+    ThreadWorker(ThreadWorker const&) = delete;
+    ThreadWorker& operator=(ThreadWorker const&) = delete;
+
+    ~ThreadWorker() {
         {
-            std::unique_lock<std::mutex> lk (iter->mtcv->mt);
-            iter->tasks.splice(iter->tasks.end(), tmp);
+            std::unique_lock<std::mutex> lk (sleep_mt);
+            die = true;
         }
-        iter->mtcv->cv.notify_one();
-        return rv;
+        sleep_cv.notify_all();
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    unsigned size() const {
+        return num_workers;
+    }
+
+    template <typename Func, typename... Ts>
+    Future do_task(Func&& f, Ts&&... ts) {
+        using Task = BoundTask<std::decay_t<Func>,std::decay_t<Ts>...>;
+
+        Slot* s = acquire();
+        s->emplace(Task{std::forward<Func>(f), std::make_tuple(std::forward<Ts>(ts)...)});
+        s->state.store(Slot::PENDING, std::memory_order_relaxed);
+
+        pending.fetch_add(1);
+
+        auto& cur = current();
+        bool queued = (cur.pool == this ?
+            workers[cur.index].tasks.push(s) :
+            push_inject(s));
+
+        if (!queued) {
+            // Queues are full, run it here.
+            execute(s);
+            return Future(this, s);
+        }
+
+        notify();
+        return Future(this, s);
     }
 };
 
@@ -0,0 +1,272 @@
+#ifndef TRANSFORM_HPP
+#define TRANSFORM_HPP
+
+#include "space.hpp"
+#include "space_table.hpp"
+
+#include <cstddef>
+#include <utility>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #include <immintrin.h>
+    #define TRANSFORM_HAS_AVX2 1
+#endif
+
+// Whole-map coordinate transform, applied to a SpaceTable in one pass.
+// Every output coordinate is scale * (one input coordinate) + offset, and
+// the offset may depend on the kind of space (Dir::NONE for rooms, or the
+// hall direction), so mult, sub, translate, transpose and flips all compose
+// into a single transform no matter how many are chained.
+class Transform {
+    // Coordinate slots, in SpaceTable order.
+    enum Slot {
+        BEGIN_R,
+        END_R,
+        BEGIN_C,
+        END_C,
+    };
+
+    int src[4] = {BEGIN_R, END_R, BEGIN_C, END_C};
+    int scale[4] = {1, 1, 1, 1};
+    int offset[3][4] = {};  // Indexed by the input's Dir, then output slot.
+    bool swap_dirs = false;
+
+    int from_width;
+    int from_height;
+    int to_width;
+    int to_height;
+
+    // Appends a transform of the current output.
+    // kind_offset is indexed by the Dir of the space at this point of the chain.
+    void then(int const (&src2)[4], int const (&scale2)[4], int const (&kind_offset)[3][4], bool swap2) {
+        int new_src[4];
+        int new_scale[4];
+        int new_offset[3][4];
+
+        for (int kind=0; kind<3; ++kind) {
+            int cur_kind = (swap_dirs && kind != 0 ? 3 - kind : kind);
+            for (int j=0; j<4; ++j) {
+                new_offset[kind][j] = scale2[j] * offset[kind][src2[j]] + kind_offset[cur_kind][j];
+            }
+        }
+
+        for (int j=0; j<4; ++j) {
+            new_src[j] = src[src2[j]];
+            new_scale[j] = scale2[j] * scale[src2[j]];
+        }
+
+        for (int j=0; j<4; ++j) {
+            src[j] = new_src[j];
+            scale[j] = new_scale[j];
+            for (int kind=0; kind<3; ++kind) {
+                offset[kind][j] = new_offset[kind][j];
+            }
+        }
+
+        swap_dirs = (swap_dirs != swap2);
+    }
+
+    static constexpr int same_src[4] = {BEGIN_R, END_R, BEGIN_C, END_C};
+    static constexpr int unit_scale[4] = {1, 1, 1, 1};
+
+    void apply_scalar(SpaceTable& table, std::size_t from) const {
+        int* out[4] = {table.begin_r.data(), table.end_r.data(), table.begin_c.data(), table.end_c.data()};
+        Dir* dir = table.dir.data();
+
+        for (std::size_t i=from, n=table.size(); i<n; ++i) {
+            int const kind = int(dir[i]);
+            int const in[4] = {out[0][i], out[1][i], out[2][i], out[3][i]};
+            for (int j=0; j<4; ++j) {
+                out[j][i] = scale[j] * in[src[j]] + offset[kind][j];
+            }
+            if (swap_dirs && kind != 0) {
+                dir[i] = Dir(3 - kind);
+            }
+        }
+    }
+
+#ifdef TRANSFORM_HAS_AVX2
+    __attribute__((target("avx2")))
+    std::size_t apply_avx2(SpaceTable& table) const {
+        int* out[4] = {table.begin_r.data(), table.end_r.data(), table.begin_c.data(), table.end_c.data()};
+        Dir* dir = table.dir.data();
+
+        __m256i vscale[4];
+        __m256i voff[3][4];
+        for (int j=0; j<4; ++j) {
+            vscale[j] = _mm256_set1_epi32(scale[j]);
+            for (int kind=0; kind<3; ++kind) {
+                voff[kind][j] = _mm256_set1_epi32(offset[kind][j]);
+            }
+        }
+
+        auto const horiz = _mm256_set1_epi32(int(Dir::HORIZ));
+        auto const vert = _mm256_set1_epi32(int(Dir::VERT));
+        auto const three = _mm256_set1_epi32(3);
+        auto const zero = _mm256_setzero_si256();
+
+        std::size_t const n = table.size();
+        std::size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            auto d = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(dir + i));
+            auto is_horiz = _mm256_cmpeq_epi32(d, horiz);
+            auto is_vert = _mm256_cmpeq_epi32(d, vert);
+
+            __m256i in[4];
+            for (int j=0; j<4; ++j) {
+                in[j] = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(out[j] + i));
+            }
+
+            for (int j=0; j<4; ++j) {
+                auto off = voff[0][j];
+                off = _mm256_blendv_epi8(off, voff[int(Dir::HORIZ)][j], is_horiz);
+                off = _mm256_blendv_epi8(off, voff[int(Dir::VERT)][j], is_vert);
+                auto v = _mm256_add_epi32(_mm256_mullo_epi32(in[src[j]], vscale[j]), off);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out[j] + i), v);
+            }
+
+            if (swap_dirs) {
+                auto is_room = _mm256_cmpeq_epi32(d, zero);
+                auto swapped = _mm256_andnot_si256(is_room, _mm256_sub_epi32(three, d));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dir + i), swapped);
+            }
+        }
+
+        return i;
+    }
+
+    static bool has_avx2() {
+        static bool const rv = __builtin_cpu_supports("avx2");
+        return rv;
+    }
+#endif
+
+public:
+
+    // Identity transform of a width by height map.
+    Transform(int width, int height)
+        : from_width(width), from_height(height), to_width(width), to_height(height) {}
+
+    int source_width() const {
+        return from_width;
+    }
+
+    int source_height() const {
+        return from_height;
+    }
+
+    int width() const {
+        return to_width;
+    }
+
+    int height() const {
+        return to_height;
+    }
+
+    // Same as Dungeon::mult().
+    Transform& mult(int x) {
+        int const scale2[4] = {x, x, x, x};
+        int const none[3][4] = {};
+        then(same_src, scale2, none, false);
+        to_width = to_width*x - x + 1;
+        to_height = to_height*x - x + 1;
+        return *this;
+    }
+
+    // Same as Dungeon::sub().
+    // Rooms lose x from their ends, halls from their beginning and thickness.
+    Transform& sub(int x) {
+        int const offsets[3][4] = {
+            { 0, -x,  0, -x},  // Room
+            { 0, -x, -x,  0},  // Dir::HORIZ hall
+            {-x,  0,  0, -x},  // Dir::VERT hall
+        };
+        then(same_src, unit_scale, offsets, false);
+        to_width -= x;
+        to_height -= x;
+        return *this;
+    }
+
+    Transform& translate(int dr, int dc) {
+        int const offsets[3][4] = {
+            {dr, dr, dc, dc},
+            {dr, dr, dc, dc},
+            {dr, dr, dc, dc},
+        };
+        then(same_src, unit_scale, offsets, false);
+        return *this;
+    }
+
+    // Swaps rows and columns, turning horizontal halls into vertical ones.
+    Transform& transpose() {
+        int const src2[4] = {BEGIN_C, END_C, BEGIN_R, END_R};
+        int const none[3][4] = {};
+        then(src2, unit_scale, none, true);
+        std::swap(to_width, to_height);
+        return *this;
+    }
+
+    // Mirrors top to bottom.
+    Transform& flip_rows() {
+        int const h = to_height;
+        int const src2[4] = {END_R, BEGIN_R, BEGIN_C, END_C};
+        int const scale2[4] = {-1, -1, 1, 1};
+        int const offsets[3][4] = {
+            {h, h, 0, 0},
+            {h, h, 0, 0},
+            {h, h, 0, 0},
+        };
+        then(src2, scale2, offsets, false);
+        return *this;
+    }
+
+    // Mirrors left to right.
+    Transform& flip_cols() {
+        int const w = to_width;
+        int const src2[4] = {BEGIN_R, END_R, END_C, BEGIN_C};
+        int const scale2[4] = {1, 1, -1, -1};
+        int const offsets[3][4] = {
+            {0, 0, w, w},
+            {0, 0, w, w},
+            {0, 0, w, w},
+        };
+        then(src2, scale2, offsets, false);
+        return *this;
+    }
+
+    // Moves a split line, as in Rect::split(), to where it separates the
+    // transformed halves: where the rooms after it begin.
+    // Returns true if the halves swap sides.
+    bool map_split(Dir& dir, int& pos) const {
+        int const in[4] = {
+            (dir == Dir::VERT ? pos : 0), (dir == Dir::VERT ? pos : 0),
+            (dir == Dir::HORIZ ? pos : 0), (dir == Dir::HORIZ ? pos : 0)};
+        if (swap_dirs) {
+            dir = flip(dir);
+        }
+        int const slot = (dir == Dir::HORIZ ? BEGIN_C : BEGIN_R);
+        pos = scale[slot] * in[src[slot]] + offset[0][slot];
+        return scale[slot] < 0;
+    }
+
+    // Transforms every space in the table, using AVX2 when the cpu has it.
+    void apply(SpaceTable& table) const {
+        std::size_t done = 0;
+#ifdef TRANSFORM_HAS_AVX2
+        if (has_avx2()) {
+            done = apply_avx2(table);
+        }
+#endif
+        apply_scalar(table, done);
+    }
+
+    // Transforms every space in the table without SIMD.
+    void apply_scalar(SpaceTable& table) const {
+        apply_scalar(table, 0);
+    }
+};
+
+constexpr int Transform::same_src[4];
+constexpr int Transform::unit_scale[4];
+
+#endif // TRANSFORM_HPP